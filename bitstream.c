@@ -0,0 +1,186 @@
+/*
+ *  iceprog -- simple programming tool for Lattice iCE FPGA
+ *
+ *  Copyright (C) 2015  Clifford Wolf <clifford@clifford.at>
+ *  Copyright (C) 2018  Piotr Esden-Tempski <piotr@esden.net>
+ *  Copyright (C) 2018  Daniel Serpell <daniel.serpell@gmail.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * bitstream.c: iCE40 bitstream parser.
+ *
+ * A bitstream is an optional comment (FF 00 text 00 FF), the preamble
+ * 7E AA 99 7E and a list of commands. Each command byte holds the opcode
+ * in the high nibble and the number of argument bytes in the low nibble,
+ * the argument is big endian. Opcode 0 takes a single argument:
+ *   01: CRAM data, 03: BRAM data, 05: reset CRC, 06: wakeup, 08: reboot.
+ * Data commands are followed by width * height / 8 bytes and two zeros.
+ * The CRC is CRC-16-CCITT over all bytes since the last reset, including
+ * the CRC check command (opcode 2) and its argument, so it must be zero
+ * after the check.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "bitstream.h"
+
+static const uint8_t preamble[4] = { 0x7E, 0xAA, 0x99, 0x7E };
+
+#include <stdarg.h>
+
+// Reports an error, unless "name" is NULL
+static void bs_error(const char *name, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!name)
+        return;
+    fprintf(stderr, "Error: %s: ", name);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+static uint16_t crc16_update(uint16_t crc, const uint8_t *data, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++) {
+        crc ^= data[i] << 8;
+        for (int k = 0; k < 8; k++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+int bitstream_parse(const uint8_t *data, uint32_t size, const char *name,
+                    struct bitstream_info *info)
+{
+    uint32_t pos = 0;
+    uint16_t crc = 0xffff;
+
+    memset(info, 0, sizeof(*info));
+
+    // Skip the comment and any 0xFF filler before the preamble
+    if (size >= 2 && data[0] == 0xFF && data[1] == 0x00) {
+        for (pos = 2; pos + 1 < size; pos++)
+            if (data[pos] == 0x00 && data[pos + 1] == 0xFF)
+                break;
+        pos += 2;
+    }
+    while (pos < size && data[pos] == 0xFF)
+        pos++;
+    if (pos + 4 > size || memcmp(data + pos, preamble, 4))
+        return BITSTREAM_NONE;
+
+    info->start = pos;
+    pos += 4;
+    while (pos < size) {
+        uint32_t at = pos, value = 0;
+        uint8_t cmd = data[pos++];
+        int n = cmd & 15;
+
+        if (pos + n > size)
+            break;
+        for (int i = 0; i < n; i++)
+            value = (value << 8) | data[pos + i];
+        crc = crc16_update(crc, data + at, 1 + n);
+        pos += n;
+
+        switch (cmd >> 4) {
+        case 0:
+            if (n == 0)         // padding
+                break;
+            if (value == 0x01 || value == 0x03) {
+                uint32_t len = info->width * info->height / 8;
+                if (!len) {
+                    bs_error(name, "data at 0x%06X before the bank size\n", at);
+                    return BITSTREAM_BAD;
+                }
+                if (pos + len + 2 > size)
+                    goto truncated;
+                if (data[pos + len] || data[pos + len + 1]) {
+                    bs_error(name, "bad end of data at 0x%06X\n", pos + len);
+                    return BITSTREAM_BAD;
+                }
+                crc = crc16_update(crc, data + pos, len + 2);
+                pos += len + 2;
+                if (value == 0x01)
+                    info->cram++;
+                else
+                    info->bram++;
+            } else if (value == 0x05) {
+                crc = 0xffff;
+            } else if (value == 0x06 || value == 0x08) {
+                info->end = pos;
+                info->reboot = value == 0x08;
+                return BITSTREAM_OK;
+            } else {
+                bs_error(name, "unknown command 0x%02X 0x%02X at 0x%06X\n", cmd, value, at);
+                return BITSTREAM_BAD;
+            }
+            break;
+        case 2:
+            if (crc) {
+                bs_error(name, "CRC error at 0x%06X\n", at);
+                return BITSTREAM_BAD;
+            }
+            info->crc_checks++;
+            break;
+        case 6:
+            info->width = value + 1;
+            break;
+        case 7:
+            info->height = value;
+            break;
+        case 4:
+            info->boot_addr = value & 0xffffff;
+            break;
+        case 1:                 // bank number
+        case 5:                 // oscillator range
+        case 8:                 // bank offset
+        case 9:                 // flags
+            break;
+        default:
+            bs_error(name, "unknown command 0x%02X at 0x%06X\n", cmd, at);
+            return BITSTREAM_BAD;
+        }
+    }
+
+truncated:
+    bs_error(name, "bitstream truncated at 0x%06X, no wakeup command\n", size);
+    return BITSTREAM_BAD;
+}
+
+void bitstream_warmboot_header(uint8_t *header, const uint32_t addr[WARMBOOT_ENTRIES])
+{
+    memset(header, 0, WARMBOOT_HEADER_SIZE);
+    for (int i = 0; i < WARMBOOT_ENTRIES; i++) {
+        uint8_t *h = header + 32 * i;
+        memcpy(h, preamble, 4);
+        h[4] = 0x92;            // flags
+        h[5] = 0x00;
+        h[6] = 0x00;
+        h[7] = 0x44;            // boot address
+        h[8] = 0x03;
+        h[9] = addr[i] >> 16;
+        h[10] = addr[i] >> 8;
+        h[11] = addr[i];
+        h[12] = 0x82;           // bank offset
+        h[13] = 0x00;
+        h[14] = 0x00;
+        h[15] = 0x01;           // reboot
+        h[16] = 0x08;
+    }
+}
@@ -0,0 +1,59 @@
+/*
+ *  iceprog -- simple programming tool for Lattice iCE FPGA
+ *
+ *  Copyright (C) 2015  Clifford Wolf <clifford@clifford.at>
+ *  Copyright (C) 2018  Piotr Esden-Tempski <piotr@esden.net>
+ *  Copyright (C) 2018  Daniel Serpell <daniel.serpell@gmail.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * bitstream.h: iCE40 bitstream parser.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Layout of an iCE40 bitstream found by bitstream_parse() */
+struct bitstream_info {
+    uint32_t start;          /* Offset of the preamble */
+    uint32_t end;            /* Offset after the wakeup or reboot command */
+    unsigned width, height;  /* Size of the last bank of data */
+    unsigned cram, bram;     /* Number of CRAM and BRAM banks */
+    unsigned crc_checks;     /* Number of CRC checks passed */
+    int reboot;              /* Ends with a warm boot instead of a wakeup */
+    uint32_t boot_addr;      /* Warm boot address, for reboot commands */
+};
+
+/* The warm boot header at flash address 0 has one 32 byte entry for the
+ * power-on image followed by one for each of the 4 warm boot images */
+#define WARMBOOT_ENTRIES        5
+#define WARMBOOT_HEADER_SIZE    (32 * WARMBOOT_ENTRIES)
+
+/* Results of bitstream_parse() */
+#define BITSTREAM_NONE      0   /* The data doesn't start like a bitstream */
+#define BITSTREAM_OK        1
+#define BITSTREAM_BAD      -1   /* Truncated or corrupt, already reported */
+
+/* Parses the iCE40 bitstream at the start of "data", checking all the
+ * commands and CRCs. "name" is only used in the error messages, no errors
+ * are reported if it is NULL. */
+int bitstream_parse(const uint8_t *data, uint32_t size, const char *name,
+                    struct bitstream_info *info);
+
+/* Builds a warm boot header, as written by icemulti, booting "addr[0]" at
+ * power-on and "addr[1..4]" on warm boot. */
+void bitstream_warmboot_header(uint8_t *header, const uint32_t addr[WARMBOOT_ENTRIES]);
@@ -0,0 +1,136 @@
+/*
+ *  iceprog -- simple programming tool for Lattice iCE FPGA
+ *
+ *  Copyright (C) 2015  Clifford Wolf <clifford@clifford.at>
+ *  Copyright (C) 2018  Piotr Esden-Tempski <piotr@esden.net>
+ *  Copyright (C) 2018  Daniel Serpell <daniel.serpell@gmail.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * cache.c: Cache of programmer capabilities, by USB serial number.
+ *
+ * Each programmer has one text file with one "key value" line for each
+ * capability, under $XDG_CACHE_HOME/iceprog or ~/.cache/iceprog.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "cache.h"
+
+#ifdef _WIN32
+# include <direct.h>
+# define mkdir(path, mode) _mkdir(path)
+#endif
+
+// Gets the cache file name, creating the directories if "create" is set
+static int cache_path(const char *serial, char *path, int size, int create)
+{
+    const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    int n;
+
+    if (xdg && xdg[0]) {
+        if (create)
+            mkdir(xdg, 0755);
+        n = snprintf(path, size, "%s/iceprog", xdg);
+    } else if (home && home[0]) {
+        snprintf(path, size, "%s/.cache", home);
+        if (create)
+            mkdir(path, 0755);
+        n = snprintf(path, size, "%s/.cache/iceprog", home);
+    } else
+        return 1;
+    if (n <= 0 || n >= size - 2)
+        return 1;
+    if (create)
+        mkdir(path, 0755);
+
+    // The serial number is used as file name, keep it safe
+    path[n++] = '/';
+    for (const char *s = serial; *s && n < size - 1; s++)
+        path[n++] = (*s == '/' || *s == '\\' || *s == '.') ? '_' : *s;
+    path[n] = 0;
+    return 0;
+}
+
+int cache_load(const char *serial, struct serprog_caps *caps)
+{
+    char path[1024], line[256];
+    int have_map = 0;
+    FILE *f;
+
+    if (cache_path(serial, path, sizeof(path), 0))
+        return 1;
+    f = fopen(path, "r");
+    if (!f)
+        return 1;
+
+    memset(caps, 0, sizeof(*caps));
+    while (fgets(line, sizeof(line), f)) {
+        char *value = strchr(line, ' ');
+        if (!value)
+            continue;
+        *value++ = 0;
+        value[strcspn(value, "\r\n")] = 0;
+
+        if (!strcmp(line, "name")) {
+            snprintf(caps->name, sizeof(caps->name), "%s", value);
+        } else if (!strcmp(line, "cmdmap") && strlen(value) == 64) {
+            for (int i = 0; i < 32; i++) {
+                unsigned byte;
+                if (sscanf(value + 2 * i, "%2x", &byte) != 1)
+                    break;
+                caps->cmdmap[i] = byte;
+            }
+            have_map = 1;
+        } else if (!strcmp(line, "serbuf")) {
+            caps->serbuf = strtoul(value, NULL, 0);
+        } else if (!strcmp(line, "opbuf")) {
+            caps->opbuf = strtoul(value, NULL, 0);
+        } else if (!strcmp(line, "rdnmaxlen")) {
+            caps->max_read = strtoul(value, NULL, 0);
+        } else if (!strcmp(line, "wrnmaxlen")) {
+            caps->max_write = strtoul(value, NULL, 0);
+        }
+    }
+    fclose(f);
+    return !have_map;
+}
+
+int cache_save(const char *serial, const struct serprog_caps *caps)
+{
+    char path[1024];
+    FILE *f;
+
+    if (cache_path(serial, path, sizeof(path), 1))
+        return 1;
+    f = fopen(path, "w");
+    if (!f)
+        return 1;
+
+    fprintf(f, "name %s\n", caps->name);
+    fprintf(f, "cmdmap ");
+    for (int i = 0; i < 32; i++)
+        fprintf(f, "%02x", caps->cmdmap[i]);
+    fprintf(f, "\n");
+    fprintf(f, "serbuf %u\n", caps->serbuf);
+    fprintf(f, "opbuf %u\n", caps->opbuf);
+    fprintf(f, "rdnmaxlen %u\n", caps->max_read);
+    fprintf(f, "wrnmaxlen %u\n", caps->max_write);
+    return fclose(f) != 0;
+}
@@ -0,0 +1,35 @@
+/*
+ *  iceprog -- simple programming tool for Lattice iCE FPGA
+ *
+ *  Copyright (C) 2015  Clifford Wolf <clifford@clifford.at>
+ *  Copyright (C) 2018  Piotr Esden-Tempski <piotr@esden.net>
+ *  Copyright (C) 2018  Daniel Serpell <daniel.serpell@gmail.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * cache.h: Cache of programmer capabilities, by USB serial number.
+ */
+
+#pragma once
+
+#include "serprog.h"
+
+/* Loads the cached capabilities of the programmer with the given USB serial
+ * number. Returns 0 on success. */
+int cache_load(const char *serial, struct serprog_caps *caps);
+
+/* Stores the capabilities of the programmer, returns 0 on success. */
+int cache_save(const char *serial, const struct serprog_caps *caps);
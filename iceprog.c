@@ -33,11 +33,33 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <fcntl.h>
+#include <pthread.h>
+#ifndef _WIN32
+# include <signal.h>
+# include <time.h>
+# include <sys/wait.h>
+#endif
 #include "serprog.h"
 #include "serial.h"
-
-static bool verbose = false;
+#include "image.h"
+#include "hash.h"
+#include "cache.h"
+#include "bitstream.h"
+#include "log.h"
+#include "patch.h"
+
+static bool skip_blank = false;
+/* Repair the pages that fail verification, instead of giving up */
+static bool repair = false;
+/* Read each page back while programming the next one */
+static bool inline_verify = false;
+static bool raw_input = false;
+/* Use the 4-byte address opcodes, for flashes larger than 16 MB */
+static bool addr4 = false;
+/* Flash size in bytes as detected from the ID, 0 if unknown */
+static uint32_t flash_size = 0;
 
 
 // ---------------------------------------------------------
@@ -123,6 +145,10 @@ enum flash_cmd {
 	FC_QPI = 0x38, /* Enter QPI mode */
 	FC_ERESET = 0x66, /* Enable Reset */
 	FC_RESET = 0x99, /* Reset Device */
+	FC_RD4B = 0x13, /* Read Data with 4-Byte Address */
+	FC_PP4B = 0x12, /* Page Program with 4-Byte Address */
+	FC_SE4B = 0x21, /* Sector Erase 4kb with 4-Byte Address */
+	FC_BE64_4B = 0xDC, /* Block Erase 64kb with 4-Byte Address */
 };
 
 static void send_spi(uint8_t *data, int n)
@@ -164,6 +190,29 @@ static void xfer_spi2(uint8_t *data_w, int n1, uint8_t *data_r, int n2)
 	}
 }
 
+static void queue_spi(uint8_t *data_w, int n1, uint8_t *data_r, int n2)
+{
+	if (n1 + n2 < 1)
+		return;
+
+        int rc = serprog_spi_queue_command(n1, n2, data_w, data_r);
+
+	if (rc) {
+		fprintf(stderr, "Write error.\n");
+		exit(2);
+	}
+}
+
+static void flush_spi()
+{
+        int rc = serprog_flush();
+
+	if (rc) {
+		fprintf(stderr, "Write error.\n");
+		exit(2);
+	}
+}
+
 
 #if 0
 static uint8_t xfer_spi_bits(uint8_t data, int n)
@@ -180,23 +229,120 @@ static uint8_t xfer_spi_bits(uint8_t data, int n)
 }
 #endif
 
+static double get_time()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
 static int get_cdone()
 {
-    /* TODO:
-	uint8_t data;
-	send_byte(MC_READB_LOW);
-	data = recv_byte();
-	// ADBUS6 (GPIOL2)
-        //
-	return (data & 0x40) != 0;
-        */
-    return 0;
+	// CDONE can only be read with the programmer GPIO extension
+	return serprog_has_gpio() && serprog_get_cdone() == 1;
+}
+
+/* Holds the FPGA in reset, so it leaves the SPI bus to the programmer */
+static void fpga_reset()
+{
+	if (!serprog_has_gpio())
+		return;
+	if (serprog_set_gpio(0))
+		exit(2);
+	usleep(1000);
+}
+
+/* Releases the FPGA reset, it then boots from the flash */
+static void fpga_release()
+{
+	if (serprog_has_gpio() && serprog_set_gpio(SERPROG_GPIO_CRESET))
+		exit(2);
+}
+
+/* Polls CDONE until the FPGA is configured or the timeout expires.
+ * Returns the time to configuration in seconds, or -1 on timeout. */
+static double fpga_wait_cdone(int timeout_ms)
+{
+	double start = get_time();
+	double deadline = start + timeout_ms / 1000.0;
+
+	if (!serprog_has_gpio()) {
+		// Without CDONE all we can do is give the FPGA time to boot
+		usleep(timeout_ms * 1000);
+		return -1;
+	}
+	for (;;) {
+		double now = get_time();
+		if (get_cdone())
+			return now - start;
+		if (now >= deadline)
+			return -1;
+		usleep(1000);
+	}
+}
+
+/* Waits for the FPGA after the reset is released and reports CDONE;
+ * exits with status 3 if it must come up but doesn't */
+static void fpga_report_cdone(int timeout_ms, bool required)
+{
+	double t = fpga_wait_cdone(timeout_ms);
+
+	if (t >= 0) {
+		fprintf(stderr, "cdone: high (configured in %.3f s)\n", t);
+		return;
+	}
+	fprintf(stderr, "cdone: low\n");
+	if (required) {
+		fprintf(stderr, "FPGA not configured after %d ms\n", timeout_ms);
+		exit(3);
+	}
 }
 
 // ---------------------------------------------------------
 // FLASH function implementations
 // ---------------------------------------------------------
 
+/* Writes the opcode and address to "buf", with 3 or 4 address bytes as the
+ * flash needs. Returns the command length. */
+static int flash_cmd_addr(uint8_t *buf, uint8_t cmd3, uint8_t cmd4, uint32_t addr)
+{
+	int n = 0;
+
+	buf[n++] = addr4 ? cmd4 : cmd3;
+	if (addr4)
+		buf[n++] = addr >> 24;
+	buf[n++] = addr >> 16;
+	buf[n++] = addr >> 8;
+	buf[n++] = addr;
+	return n;
+}
+
+/* Returns the flash size in bytes from the SFDP basic parameter table, or
+ * 0 if the flash has no SFDP */
+static uint32_t flash_sfdp_size()
+{
+	uint8_t hdr[5 + 16] = { FC_RSFDP, 0, 0, 0, 0 };
+	uint8_t bfpt[5 + 8] = { FC_RSFDP };
+	uint32_t ptr, density;
+
+	// SFDP header and first parameter header, the basic flash parameters
+	xfer_spi(hdr, 5, 16);
+	if (memcmp(hdr + 5, "SFDP", 4) || hdr[5 + 8] != 0x00)
+		return 0;
+	ptr = hdr[5 + 12] | (hdr[5 + 13] << 8) | (hdr[5 + 14] << 16);
+
+	bfpt[1] = ptr >> 16;
+	bfpt[2] = ptr >> 8;
+	bfpt[3] = ptr;
+	xfer_spi(bfpt, 5, 8);
+
+	// Second DWORD: density in bits minus one, or 2^N bits if bit 31 is set
+	density = bfpt[5 + 4] | (bfpt[5 + 5] << 8) | (bfpt[5 + 6] << 16) | ((uint32_t)bfpt[5 + 7] << 24);
+	if (density & 0x80000000)
+		return (density & 0x7fffffff) >= 35 ? 0 : 1u << ((density & 0x7fffffff) - 3);
+	return density / 8 + 1;
+}
+
 static void flash_read_id()
 {
 	/* JEDEC ID structure:
@@ -212,8 +358,7 @@ static void flash_read_id()
 	uint8_t data[260] = { FC_JEDECID };
 	int len = 4; // 4 response bytes
 
-	if (verbose)
-		fprintf(stderr, "read flash ID..\n");
+	log_printf(LOG_DEBUG, "read flash ID..\n");
 
 	// Write command and read first 4 bytes
 	xfer_spi(data, 1, len);
@@ -234,6 +379,16 @@ static void flash_read_id()
 	for (int i = 1; i < len; i++)
 		fprintf(stderr, " 0x%02X", data[i]);
 	fprintf(stderr, "\n");
+
+	// Most vendors encode the capacity as log2 of the size in bytes, if
+	// the value doesn't look like that ask the SFDP tables.
+	if (data[3] >= 0x10 && data[3] <= 0x1f)
+		flash_size = 1u << data[3];
+	else
+		flash_size = flash_sfdp_size();
+	addr4 = flash_size > 0x1000000;
+	if (flash_size)
+		fprintf(stderr, "flash size: %u kB%s\n", flash_size / 1024, addr4 ? ", using 4-byte addresses" : "");
 }
 
 static void flash_reset()
@@ -268,44 +423,34 @@ static uint8_t flash_read_status()
 
 	xfer_spi(data, 1, 1);
 
-	if (verbose) {
-		fprintf(stderr, "SR1: 0x%02X\n", data[1]);
-		fprintf(stderr, " - SPRL: %s\n",
+	if (log_enabled(LOG_TRACE)) {
+		log_printf(LOG_TRACE, "SR1: 0x%02X\n", data[1]);
+		log_printf(LOG_TRACE, " - SPRL: %s\n",
 			((data[1] & (1 << 7)) == 0) ? 
 				"unlocked" : 
 				"locked");
-		fprintf(stderr, " -  SPM: %s\n",
+		log_printf(LOG_TRACE, " -  SPM: %s\n",
 			((data[1] & (1 << 6)) == 0) ?
 				"Byte/Page Prog Mode" :
 				"Sequential Prog Mode");
-		fprintf(stderr, " -  EPE: %s\n",
+		log_printf(LOG_TRACE, " -  EPE: %s\n",
 			((data[1] & (1 << 5)) == 0) ?
 				"Erase/Prog success" :
 				"Erase/Prog error");
-		fprintf(stderr, "-  SPM: %s\n",
+		log_printf(LOG_TRACE, "-  SPM: %s\n",
 			((data[1] & (1 << 4)) == 0) ?
 				"~WP asserted" :
 				"~WP deasserted");
-		fprintf(stderr, " -  SWP: ");
-		switch((data[1] >> 2) & 0x3) {
-			case 0:
-				fprintf(stderr, "All sectors unprotected\n");
-				break;
-			case 1:
-				fprintf(stderr, "Some sectors protected\n");
-				break;
-			case 2:
-				fprintf(stderr, "Reserved (xxxx 10xx)\n");
-				break;
-			case 3:
-				fprintf(stderr, "All sectors protected\n");
-				break;
-		}
-		fprintf(stderr, " -  WEL: %s\n",
+		static const char *const swp[] = {
+			"All sectors unprotected", "Some sectors protected",
+			"Reserved (xxxx 10xx)", "All sectors protected"
+		};
+		log_printf(LOG_TRACE, " -  SWP: %s\n", swp[(data[1] >> 2) & 0x3]);
+		log_printf(LOG_TRACE, " -  WEL: %s\n",
 			((data[1] & (1 << 1)) == 0) ?
 				"Not write enabled" :
 				"Write enabled");
-		fprintf(stderr, " - ~RDY: %s\n",
+		log_printf(LOG_TRACE, " - ~RDY: %s\n",
 			((data[1] & (1 << 0)) == 0) ?
 				"Ready" :
 				"Busy");
@@ -318,19 +463,18 @@ static uint8_t flash_read_status()
 
 static void flash_write_enable()
 {
-	if (verbose) {
-		fprintf(stderr, "status before enable:\n");
+	if (log_enabled(LOG_TRACE)) {
+		log_printf(LOG_TRACE, "status before enable:\n");
 		flash_read_status();
 	}
 
-	if (verbose)
-		fprintf(stderr, "write enable..\n");
+	log_printf(LOG_DEBUG, "write enable..\n");
 
 	uint8_t data[1] = { FC_WE };
 	send_spi(data, 1);
 
-	if (verbose) {
-		fprintf(stderr, "status after enable:\n");
+	if (log_enabled(LOG_TRACE)) {
+		log_printf(LOG_TRACE, "status after enable:\n");
 		flash_read_status();
 	}
 }
@@ -343,58 +487,68 @@ static void flash_bulk_erase()
 	send_spi(data, 1);
 }
 
-static void flash_64kB_sector_erase(int addr)
+static void flash_64kB_sector_erase(uint32_t addr)
 {
 	fprintf(stderr, "erase 64kB sector at 0x%06X..\n", addr);
 
-	uint8_t command[4] = { FC_BE64, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
+	uint8_t command[5];
 
-	send_spi(command, 4);
+	send_spi(command, flash_cmd_addr(command, FC_BE64, FC_BE64_4B, addr));
 }
 
-static void flash_prog(int addr, uint8_t *data, int n)
+static void flash_4kB_sector_erase(uint32_t addr)
 {
-	static uint8_t packet[256+4];
+	fprintf(stderr, "erase 4kB sector at 0x%06X..\n", addr);
 
-	if (verbose)
-		fprintf(stderr, "prog 0x%06X +0x%03X..\n", addr, n);
+	uint8_t command[5];
 
-        if (n > 256)
-        {
-		fprintf(stderr, "Error: n  = %d > 256\n", n);
-                exit(2);
-        }
+	send_spi(command, flash_cmd_addr(command, FC_SE, FC_SE4B, addr));
+}
 
-	uint8_t command[4] = { FC_PP, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
-        memcpy( packet, command, 4);
-        memcpy( packet + 4, data, n);
+/* Maximum number of --patch fields */
+#define PATCHES_MAX 16
 
-	send_spi(packet, 4 + n);
+/* Size of the verbose log buffer */
+#define LOG_RING_SIZE (1 << 20)
 
-	if (verbose)
-		for (int i = 0; i < n; i++)
-			fprintf(stderr, "%02x%c", data[i], i == n - 1 || i % 32 == 31 ? '\n' : ' ');
-}
+/* Largest single SPI read used */
+#define FAST_READ_MAX 0x10000
 
-static void flash_read(int addr, uint8_t *data, int n)
+/* Reads "size" bytes from flash, in chunks sized from the link profile,
+ * keeping the profiled number of reads in flight. */
+static void flash_read_fast(uint32_t addr, uint8_t *data, uint32_t size)
 {
-	if (verbose)
-		fprintf(stderr, "read 0x%06X +0x%03X..\n", addr, n);
-
-	uint8_t command[4] = { FC_RD, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8), (uint8_t)addr };
-
-	memset(data, 0, n);
-	xfer_spi2(command, 4, data, n);
+	struct serprog_link link;
+	uint8_t (*cmds)[5];
+	uint32_t max;
+
+	serprog_get_link(&link);
+	max = link.chunk > FAST_READ_MAX ? FAST_READ_MAX : link.chunk;
+	log_printf(LOG_DEBUG, "read 0x%06X +0x%03X..\n", addr, size);
+
+	cmds = malloc(link.depth * sizeof(*cmds));
+	if (!cmds) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (uint32_t pos = 0, i = 0; pos < size; pos += max) {
+		int len = flash_cmd_addr(cmds[i], FC_RD, FC_RD4B, addr + pos);
+		queue_spi(cmds[i], len, data + pos, size - pos > max ? max : size - pos);
+		if (++i == link.depth) {
+			flush_spi();
+			i = 0;
+		}
+	}
+	flush_spi();
+	free(cmds);
 
-	if (verbose)
-		for (int i = 0; i < n; i++)
-			fprintf(stderr, "%02x%c", data[i], i == n - 1 || i % 32 == 31 ? '\n' : ' ');
+	log_hex(LOG_TRACE, addr, data, size);
 }
 
 static void flash_wait()
 {
-	if (verbose)
-		fprintf(stderr, "waiting..");
+	double start = get_time();
+	int polls = 0;
 
 	int count = 0;
 	while (1)
@@ -402,35 +556,65 @@ static void flash_wait()
 		uint8_t data[2] = { FC_RSR1 };
 
 		xfer_spi(data, 1, 1);
+		polls++;
 
 		if ((data[1] & 0x01) == 0) {
-			if (count < 2) {
+			if (count < 2)
 				count++;
-				if (verbose) {
-					fprintf(stderr, "r");
-					fflush(stderr);
-				}
-			} else {
-				if (verbose) {
-					fprintf(stderr, "R");
-					fflush(stderr);
-				}
+			else
 				break;
-			}
-		} else {
-			if (verbose) {
-				fprintf(stderr, ".");
-				fflush(stderr);
-			}
+		} else
 			count = 0;
-		}
 
 		usleep(1000);
 	}
 
-	if (verbose)
-		fprintf(stderr, "\n");
+	log_printf(LOG_DEBUG, "waited %.3f s, %d polls\n", get_time() - start, polls);
+}
+
+/* Program one page: the write enable, page program and first status poll
+ * are sent together, so a page usually needs only two round trips. */
+static void flash_queue_prog_page(uint32_t addr, const uint8_t *data, int n, uint8_t *status)
+{
+	static uint8_t packet[256+5];
+	static uint8_t cmd_we[1] = { FC_WE };
+	static uint8_t cmd_rsr[1] = { FC_RSR1 };
+
+        if (n > 256)
+        {
+		fprintf(stderr, "Error: n  = %d > 256\n", n);
+                exit(2);
+        }
+
+	int len = flash_cmd_addr(packet, FC_PP, FC_PP4B, addr);
+        memcpy( packet + len, data, n);
+
+	queue_spi(cmd_we, 1, NULL, 0);
+	queue_spi(packet, len + n, NULL, 0);
+	queue_spi(cmd_rsr, 1, status, 1);
+
+	log_printf(LOG_DEBUG, "prog 0x%06X +0x%03X..\n", addr, n);
+	log_hex(LOG_TRACE, addr, data, n);
+}
+
+/* Polls the status from the first poll until the page program is done */
+static void flash_wait_prog(uint8_t status)
+{
+	uint8_t cmd_rsr[1] = { FC_RSR1 };
+
+	while (status & 0x01) {
+		usleep(100);
+		xfer_spi2(cmd_rsr, 1, &status, 1);
+	}
+}
 
+static void flash_prog_page(uint32_t addr, uint8_t *data, int n)
+{
+	uint8_t status = 0;
+
+	flash_queue_prog_page(addr, data, n, &status);
+	flush_spi();
+	flash_wait_prog(status);
 }
 
 static void flash_disable_protection()
@@ -453,198 +637,2124 @@ static void flash_disable_protection()
 
 }
 
-// ---------------------------------------------------------
-// iceprog implementation
-// ---------------------------------------------------------
-
-static void help(const char *progname)
+/* Returns true if all "n" bytes are 0xFF, checking a word at a time */
+static bool buffer_is_blank(const uint8_t *data, uint32_t n)
 {
-	fprintf(stderr, "Simple programming tool for iCE40 FPGA using SERPROG programmers.\n");
-	fprintf(stderr, "Usage: %s [-b|-n|-c] <input file>\n", progname);
-	fprintf(stderr, "       %s -r|-R<bytes> <output file>\n", progname);
-	fprintf(stderr, "       %s -S <input file>\n", progname);
-	fprintf(stderr, "       %s -t\n", progname);
-	fprintf(stderr, "\n");
-	fprintf(stderr, "General options:\n");
-	fprintf(stderr, "  -d <device string>    use the specified serial device [default autodetect]\n");
-	fprintf(stderr, "  -o <offset in bytes>  start address for read/write [default: 0]\n");
-	fprintf(stderr, "                          (append 'k' to the argument for size in kilobytes,\n");
-	fprintf(stderr, "                          or 'M' for size in megabytes)\n");
-	fprintf(stderr, "  -s                    slow SPI (50 kHz instead of 6 MHz)\n");
-	fprintf(stderr, "  -v                    verbose output\n");
-	fprintf(stderr, "\n");
-	fprintf(stderr, "Mode of operation:\n");
-	fprintf(stderr, "  [default]             write file contents to flash, then verify\n");
-	fprintf(stderr, "  -r                    read first 256 kB from flash and write to file\n");
-	fprintf(stderr, "  -R <size in bytes>    read the specified number of bytes from flash\n");
-	fprintf(stderr, "                          (append 'k' to the argument for size in kilobytes,\n");
-	fprintf(stderr, "                          or 'M' for size in megabytes)\n");
-	fprintf(stderr, "  -c                    do not write flash, only verify (`check')\n");
-	fprintf(stderr, "  -t                    just read the flash ID sequence\n");
-	fprintf(stderr, "\n");
-	fprintf(stderr, "Erase mode (only meaningful in default mode):\n");
-	fprintf(stderr, "  [default]             erase aligned chunks of 64kB in write mode\n");
-	fprintf(stderr, "                          This means that some data after the written data (or\n");
-	fprintf(stderr, "                          even before when -o is used) may be erased as well.\n");
-	fprintf(stderr, "  -b                    bulk erase entire flash before writing\n");
-	fprintf(stderr, "  -e <size in bytes>    erase flash as if we were writing that number of bytes\n");
-	fprintf(stderr, "  -n                    do not erase flash before writing\n");
-	fprintf(stderr, "  -p                    disable write protection before erasing or writing\n");
-	fprintf(stderr, "                          This can be useful if flash memory appears to be\n");
-	fprintf(stderr, "                          bricked and won't respond to erasing or programming.\n");
-	fprintf(stderr, "\n");
-	fprintf(stderr, "Miscellaneous options:\n");
-	fprintf(stderr, "      --help            display this help and exit\n");
-	fprintf(stderr, "  --                    treat all remaining arguments as filenames\n");
-	fprintf(stderr, "\n");
-	fprintf(stderr, "Exit status:\n");
-	fprintf(stderr, "  0 on success,\n");
-	fprintf(stderr, "  1 if a non-hardware error occurred (e.g., failure to read from or\n");
-	fprintf(stderr, "    write to a file, or invoked with invalid options),\n");
-	fprintf(stderr, "  2 if communication with the hardware failed (e.g., cannot find the\n");
-	fprintf(stderr, "    iCE FTDI USB device),\n");
-	fprintf(stderr, "  3 if verification of the data failed.\n");
-	fprintf(stderr, "\n");
-	fprintf(stderr, "Notes for iCEstick (iCE40HX-1k devel board):\n");
-	fprintf(stderr, "  An unmodified iCEstick can only be programmed via the serial flash.\n");
-	fprintf(stderr, "  Direct programming of the SRAM is not supported. For direct SRAM\n");
-	fprintf(stderr, "  programming the flash chip and one zero ohm resistor must be desoldered\n");
-	fprintf(stderr, "  and the programmer SI pin must be connected to the iCE SPI_SI pin, as shown\n");
-	fprintf(stderr, "  in this picture:\n");
-	fprintf(stderr, "  http://www.clifford.at/gallery/2014-elektronik/IMG_20141115_183838\n");
-	fprintf(stderr, "\n");
-	fprintf(stderr, "Notes for the iCE40-HX8K Breakout Board:\n");
-	fprintf(stderr, "  Make sure that the jumper settings on the board match the selected\n");
-	fprintf(stderr, "  mode (SRAM or FLASH). See the iCE40-HX8K user manual for details.\n");
-	fprintf(stderr, "\n");
-	fprintf(stderr, "If you have a bug report, please file an issue on github:\n");
-	fprintf(stderr, "  https://github.com/dmsc/iceprog-fser/issues\n");
+	uint64_t acc = ~(uint64_t)0;
+	uint32_t i = 0;
+
+	for (; i + 64 <= n; i += 64) {
+		uint64_t w[8];
+		memcpy(w, data + i, 64);
+		acc &= w[0] & w[1] & w[2] & w[3] & w[4] & w[5] & w[6] & w[7];
+		if (acc != ~(uint64_t)0)
+			return false;
+	}
+	for (; i < n; i++)
+		if (data[i] != 0xff)
+			return false;
+	return true;
 }
 
-int main(int argc, char **argv)
+/* Returns true if the flash range is erased */
+static bool flash_is_blank(uint32_t addr, uint32_t size)
 {
-	/* used for error reporting */
-	const char *my_name = argv[0];
-	for (size_t i = 0; argv[0][i]; i++)
-		if (argv[0][i] == '/')
-			my_name = argv[0] + i + 1;
+	static uint8_t buffer[FAST_READ_MAX];
 
-	int read_size = 256 * 1024;
-	int erase_size = 0;
-	int rw_offset = 0;
-
-	bool read_mode = false;
-	bool check_mode = false;
-	bool erase_mode = false;
-	bool bulk_erase = false;
-	bool dont_erase = false;
-	bool test_mode = false;
-	bool slow_clock = false;
-	bool disable_protect = false;
-	const char *filename = NULL;
-	const char *devstr = NULL;
+	for (uint32_t pos = 0, n; pos < size; pos += n) {
+		n = size - pos > FAST_READ_MAX ? FAST_READ_MAX : size - pos;
+		flash_read_fast(addr + pos, buffer, n);
+		if (!buffer_is_blank(buffer, n))
+			return false;
+	}
+	return true;
+}
 
-	static struct option long_options[] = {
-		{"help", no_argument, NULL, -2},
-		{NULL, 0, NULL, 0}
-	};
+/* Reads the flash range, reporting all the 4kB sectors that are not
+ * erased. Returns the number of non blank sectors. */
+static int flash_blank_check(uint32_t addr, uint32_t size)
+{
+	static uint8_t buffer[FAST_READ_MAX];
+	uint32_t bad_start = 0, bad_end = 0;
+	int count = 0;
 
-	/* Decode command line parameters */
-	int opt;
-	char *endptr;
-	while ((opt = getopt_long(argc, argv, "d:I:rR:e:o:cbnStvsp", long_options, NULL)) != -1) {
-		switch (opt) {
-		case 'd': /* device string */
-			devstr = optarg;
-			break;
-		case 'r': /* Read 256 bytes to file */
-			read_mode = true;
-			break;
-		case 'R': /* Read n bytes to file */
-			read_mode = true;
-			read_size = strtol(optarg, &endptr, 0);
-			if (*endptr == '\0')
-				/* ok */;
-			else if (!strcmp(endptr, "k"))
-				read_size *= 1024;
-			else if (!strcmp(endptr, "M"))
-				read_size *= 1024 * 1024;
-			else {
-				fprintf(stderr, "%s: `%s' is not a valid size\n", my_name, optarg);
-				return EXIT_FAILURE;
-			}
-			break;
-		case 'e': /* Erase blocks as if we were writing n bytes */
-			erase_mode = true;
-			erase_size = strtol(optarg, &endptr, 0);
-			if (*endptr == '\0')
-				/* ok */;
-			else if (!strcmp(endptr, "k"))
-				erase_size *= 1024;
-			else if (!strcmp(endptr, "M"))
-				erase_size *= 1024 * 1024;
-			else {
-				fprintf(stderr, "%s: `%s' is not a valid size\n", my_name, optarg);
-				return EXIT_FAILURE;
-			}
-			break;
-		case 'o': /* set address offset */
-			rw_offset = strtol(optarg, &endptr, 0);
-			if (*endptr == '\0')
-				/* ok */;
-			else if (!strcmp(endptr, "k"))
-				rw_offset *= 1024;
-			else if (!strcmp(endptr, "M"))
-				rw_offset *= 1024 * 1024;
-			else {
-				fprintf(stderr, "%s: `%s' is not a valid offset\n", my_name, optarg);
-				return EXIT_FAILURE;
+	for (uint32_t pos = 0, n; pos < size; pos += n) {
+		n = size - pos > FAST_READ_MAX ? FAST_READ_MAX : size - pos;
+		flash_read_fast(addr + pos, buffer, n);
+		for (uint32_t s = 0, sn; s < n; s += sn) {
+			uint32_t a = addr + pos + s;
+			sn = 0x1000 - a % 0x1000;
+			if (sn > n - s)
+				sn = n - s;
+			if (buffer_is_blank(buffer + s, sn))
+				continue;
+			count++;
+			if (bad_end != a) {
+				if (bad_end)
+					fprintf(stderr, "not blank: 0x%06X-0x%06X\n", bad_start, bad_end - 1);
+				bad_start = a;
 			}
-			break;
-		case 'c': /* do not write just check */
-			check_mode = true;
-			break;
-		case 'b': /* bulk erase before writing */
-			bulk_erase = true;
-			break;
-		case 'n': /* do not erase before writing */
-			dont_erase = true;
-			break;
-		case 't': /* just read flash id */
-			test_mode = true;
-			break;
-		case 'v': /* provide verbose output */
-			verbose = true;
-			break;
-		case 's': /* use slow SPI clock */
-			slow_clock = true;
-			break;
-		case 'p': /* disable flash protect before erase/write */
-			disable_protect = true;
-			break;
-		case -2:
-			help(argv[0]);
-			return EXIT_SUCCESS;
-		default:
-			/* error message has already been printed */
-			fprintf(stderr, "Try `%s --help' for more information.\n", argv[0]);
-			return EXIT_FAILURE;
+			bad_end = a + sn;
 		}
 	}
+	if (bad_end)
+		fprintf(stderr, "not blank: 0x%06X-0x%06X\n", bad_start, bad_end - 1);
+	return count;
+}
 
-	/* Make sure that the combination of provided parameters makes sense */
-
-	if (read_mode + erase_mode + check_mode + test_mode > 1) {
-		fprintf(stderr, "%s: options `-r'/`-R', `-e`, `-c', `-S', and `-t' are mutually exclusive\n", my_name);
-		return EXIT_FAILURE;
+/* Programs the image data inside the flash range [begin, end) */
+static void flash_prog_range(const struct image *img, uint32_t begin, uint32_t end)
+{
+	for (int i = 0; i < img->count; i++) {
+		const struct image_region *r = &img->regions[i];
+		uint32_t pos = r->addr < begin ? begin - r->addr : 0;
+		uint32_t size = r->addr + r->size > end ? end - r->addr : r->size;
+		if (r->addr >= end || r->addr + r->size <= begin)
+			continue;
+		for (uint32_t n; pos < size; pos += n) {
+			n = 256 - (r->addr + pos) % 256;
+			if (n > size - pos)
+				n = size - pos;
+			flash_prog_page(r->addr + pos, r->data + pos, n);
+		}
 	}
+}
 
-	if (bulk_erase && dont_erase) {
-		fprintf(stderr, "%s: options `-b' and `-n' are mutually exclusive\n", my_name);
-		return EXIT_FAILURE;
+/* Returns true if the image data inside the flash range [begin, end) is
+ * equal to the flash contents */
+static bool flash_check_range(const struct image *img, uint32_t begin, uint32_t end)
+{
+	for (int i = 0; i < img->count; i++) {
+		const struct image_region *r = &img->regions[i];
+		uint32_t pos = r->addr < begin ? begin - r->addr : 0;
+		uint32_t size = r->addr + r->size > end ? end - r->addr : r->size;
+		if (r->addr >= end || r->addr + r->size <= begin)
+			continue;
+		for (uint32_t n; pos < size; pos += n) {
+			static uint8_t buffer_flash[FAST_READ_MAX];
+			n = size - pos > FAST_READ_MAX ? FAST_READ_MAX : size - pos;
+			flash_read_fast(r->addr + pos, buffer_flash, n);
+			if (memcmp(r->data + pos, buffer_flash, n))
+				return false;
+		}
 	}
+	return true;
+}
 
-	if (disable_protect && (read_mode || check_mode || test_mode)) {
+// ---------------------------------------------------------
+// Read-modify-write
+// ---------------------------------------------------------
+
+/* Typical flash timings in seconds, from the W25Q128JV datasheet */
+#define T_PAGE_PROG   0.0007
+#define T_WRITE_SR    0.010
+#define T_ERASE_4K    0.045
+#define T_ERASE_64K   0.150
+#define T_ERASE_CHIP  40.0
+
+/* Programs the pages of "data" that differ from "old", pages are assumed
+ * to hold "old" already. */
+static void flash_prog_changes(uint32_t addr, const uint8_t *old, uint8_t *data, uint32_t size)
+{
+	for (uint32_t pos = 0; pos < size; pos += 256)
+		if (memcmp(old + pos, data + pos, 256))
+			flash_prog_page(addr + pos, data + pos, 256);
+}
+
+/* Updates one 4kB sector holding "old" to the image data, preserving the
+ * flash data not covered by the image. Sectors that already hold the data
+ * are not touched, and sectors that only need bits cleared are not erased. */
+static void flash_update_sector(const struct image *img, uint32_t addr, const uint8_t *old)
+{
+	static uint8_t blank[4096];
+	uint8_t data[4096];
+
+	memset(blank, 0xff, sizeof(blank));
+	memcpy(data, old, 4096);
+	image_read(img, addr, data, 4096);
+
+	if (!memcmp(old, data, 4096)) {
+		log_printf(LOG_DEBUG, "sector 0x%06X unchanged\n", addr);
+		return;
+	}
+
+	bool clear_only = true;
+	for (int i = 0; i < 4096; i++)
+		if ((old[i] & data[i]) != data[i])
+			clear_only = false;
+	if (clear_only) {
+		log_printf(LOG_DEBUG, "sector 0x%06X updated without erase\n", addr);
+		flash_prog_changes(addr, old, data, 4096);
+		return;
+	}
+
+	flash_write_enable();
+	flash_4kB_sector_erase(addr);
+	flash_wait();
+	flash_prog_changes(addr, blank, data, 4096);
+}
+
+/* Writes the image data inside one 4kB sector, preserving the flash data
+ * not covered by the image. */
+static void flash_write_sector_keep(const struct image *img, uint32_t addr)
+{
+	uint8_t old[4096];
+
+	if (!image_read(img, addr, NULL, 4096))
+		return;
+	flash_read_fast(addr, old, 4096);
+	flash_update_sector(img, addr, old);
+}
+
+/* Writes the image without losing flash data outside of it, comparing each
+ * 64kB block with the flash first: only the 4kB sectors that change are
+ * written, so boards already holding most of the image get a quick update.
+ * Blocks fully covered by the image that need many sector erases are
+ * erased at once instead. */
+static void flash_write_keep(const struct image *img)
+{
+	static uint8_t old[0x10000], data[0x10000];
+	uint32_t last_block = 0xffffffff;
+
+	for (int i = 0; i < img->count; i++) {
+		const struct image_region *r = &img->regions[i];
+		for (uint32_t blk = r->addr & ~0xffff; blk < r->addr + r->size; blk += 0x10000) {
+			int erases = 0;
+
+			if (blk == last_block)
+				continue;
+			last_block = blk;
+
+			flash_read_fast(blk, old, 0x10000);
+			memcpy(data, old, 0x10000);
+			image_read(img, blk, data, 0x10000);
+			for (uint32_t pos = 0; pos < 0x10000; pos += 0x1000) {
+				for (uint32_t j = pos; j < pos + 0x1000; j++) {
+					if ((old[j] & data[j]) != data[j]) {
+						erases++;
+						break;
+					}
+				}
+			}
+
+			if (image_read(img, blk, NULL, 0x10000) == 0x10000 && erases * T_ERASE_4K > T_ERASE_64K) {
+				flash_write_enable();
+				flash_64kB_sector_erase(blk);
+				flash_wait();
+				flash_prog_range(img, blk, blk + 0x10000);
+			} else {
+				for (uint32_t addr = blk; addr < blk + 0x10000; addr += 0x1000)
+					if (image_read(img, addr, NULL, 0x1000))
+						flash_update_sector(img, addr, old + (addr - blk));
+			}
+		}
+	}
+}
+
+// ---------------------------------------------------------
+// Verify and repair
+// ---------------------------------------------------------
+
+/* A page that failed verification */
+struct bad_page {
+	uint32_t addr;
+	bool erase;	// needs some bit set, so its sector must be erased
+};
+
+struct bad_pages {
+	struct bad_page *pages;
+	int count, alloc;
+};
+
+static void bad_page_add(struct bad_pages *b, uint32_t addr, bool erase)
+{
+	if (b->count && b->pages[b->count - 1].addr == addr) {
+		b->pages[b->count - 1].erase |= erase;
+		return;
+	}
+	if (b->count == b->alloc) {
+		b->alloc = b->alloc ? 2 * b->alloc : 64;
+		b->pages = realloc(b->pages, b->alloc * sizeof(*b->pages));
+		if (!b->pages) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	b->pages[b->count].addr = addr;
+	b->pages[b->count].erase = erase;
+	b->count++;
+}
+
+/* Verifies the whole range, collecting every page that differs */
+static void flash_find_bad_pages(const struct image *img, uint32_t begin, uint32_t end,
+				 struct bad_pages *bad)
+{
+	static uint8_t buffer_flash[FAST_READ_MAX];
+
+	for (int i = 0; i < img->count; i++) {
+		const struct image_region *r = &img->regions[i];
+		uint32_t pos = r->addr < begin ? begin - r->addr : 0;
+		uint32_t size = r->addr + r->size > end ? end - r->addr : r->size;
+		if (r->addr >= end || r->addr + r->size <= begin)
+			continue;
+		for (uint32_t n; pos < size; pos += n) {
+			n = size - pos > FAST_READ_MAX ? FAST_READ_MAX : size - pos;
+			flash_read_fast(r->addr + pos, buffer_flash, n);
+			if (!memcmp(r->data + pos, buffer_flash, n))
+				continue;
+			for (uint32_t j = 0; j < n; j++) {
+				uint8_t want = r->data[pos + j], have = buffer_flash[j];
+				if (want != have)
+					bad_page_add(bad, (r->addr + pos + j) & ~0xff, (have & want) != want);
+			}
+		}
+	}
+}
+
+static bool bad_sector_needs_erase(const struct bad_pages *bad, uint32_t sector)
+{
+	for (int i = 0; i < bad->count; i++)
+		if (bad->pages[i].erase && (bad->pages[i].addr & ~0xfff) == sector)
+			return true;
+	return false;
+}
+
+/* Size of a repair: pages are programmed again, sectors rewritten */
+#define REPAIR_SIZE(r) ((r)->erase ? 0x1000 : 0x100)
+
+/* Prints the repaired ranges, merging the consecutive ones */
+static void print_repairs(const struct bad_page *done, int count)
+{
+	for (int i = 0, j; i < count; i = j) {
+		uint32_t end = done[i].addr + REPAIR_SIZE(&done[i]);
+		for (j = i + 1; j < count && done[j].addr == end && done[j].erase == done[i].erase; j++)
+			end += REPAIR_SIZE(&done[j]);
+		fprintf(stderr, "repaired 0x%06X +0x%06X, %s\n", done[i].addr, end - done[i].addr,
+			done[i].erase ? "sectors erased and rewritten" : "pages programmed");
+	}
+}
+
+/* Verifies the range and repairs the pages that differ: pages that only
+ * need bits cleared are programmed again, the sectors holding other pages
+ * are erased and rewritten, keeping the data outside the image. Returns
+ * false if the repaired data still doesn't verify. */
+static bool flash_verify_repair(const struct image *img, uint32_t begin, uint32_t end)
+{
+	struct bad_pages bad = { NULL, 0, 0 };
+	struct bad_page *done;
+	bool ok = true;
+	int count = 0;
+
+	flash_find_bad_pages(img, begin, end, &bad);
+	if (!bad.count)
+		return true;
+	fprintf(stderr, "Found %d pages differing between flash and file, repairing..\n", bad.count);
+
+	done = malloc(bad.count * sizeof(*done));
+	if (!done) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < bad.count; i++) {
+		uint32_t addr = bad.pages[i].addr, sector = addr & ~0xfff;
+
+		if (bad_sector_needs_erase(&bad, sector)) {
+			if (count && done[count - 1].addr == sector)
+				continue;
+			flash_write_sector_keep(img, sector);
+			done[count].addr = sector;
+			done[count++].erase = true;
+		} else {
+			uint8_t data[256];
+			memset(data, 0xff, sizeof(data));
+			image_read(img, addr, data, 256);
+			flash_prog_page(addr, data, 256);
+			done[count].addr = addr;
+			done[count++].erase = false;
+		}
+	}
+	print_repairs(done, count);
+
+	for (int i = 0; i < count && ok; i++)
+		ok = flash_check_range(img, done[i].addr, done[i].addr + REPAIR_SIZE(&done[i]));
+	free(done);
+	free(bad.pages);
+	return ok;
+}
+
+/* Programs like flash_prog_range(), but reads each page back in the same
+ * round trip as the program command of the next page, so differences are
+ * found before the rest of the image is written. With --repair the page is
+ * repaired and programming goes on. Returns false, and the address of the
+ * page in "bad_addr", at the first difference not repaired. */
+static bool flash_prog_verify_range(const struct image *img, uint32_t begin, uint32_t end,
+				    uint32_t *bad_addr)
+{
+	uint32_t prev_addr = 0;
+	const uint8_t *prev_data = NULL;
+	uint8_t readback[256], cmd_rd[5];
+	int prev_n = 0;
+
+	for (int i = 0; i < img->count; i++) {
+		const struct image_region *r = &img->regions[i];
+		uint32_t pos = r->addr < begin ? begin - r->addr : 0;
+		uint32_t size = r->addr + r->size > end ? end - r->addr : r->size;
+		if (r->addr >= end || r->addr + r->size <= begin)
+			continue;
+		// The last page of the region is read back on its own
+		for (uint32_t n; pos < size || prev_n; pos += n) {
+			uint8_t status = 0;
+
+			n = 256 - (r->addr + pos) % 256;
+			if (n > size - pos)
+				n = size - pos;
+			if (prev_n)
+				queue_spi(cmd_rd, flash_cmd_addr(cmd_rd, FC_RD, FC_RD4B, prev_addr),
+					  readback, prev_n);
+			if (n)
+				flash_queue_prog_page(r->addr + pos, r->data + pos, n, &status);
+			flush_spi();
+			flash_wait_prog(status);
+
+			if (prev_n && memcmp(readback, prev_data, prev_n) &&
+			    (!repair || !flash_verify_repair(img, prev_addr, prev_addr + prev_n))) {
+				*bad_addr = prev_addr;
+				return false;
+			}
+			prev_addr = r->addr + pos;
+			prev_data = r->data + pos;
+			prev_n = n;
+		}
+	}
+	return true;
+}
+
+// ---------------------------------------------------------
+// Programming journal
+// ---------------------------------------------------------
+
+/* Block states stored in the journal */
+#define JOURNAL_ERASED     1
+#define JOURNAL_PROGRAMMED 2
+
+/* FNV-1a hash of the image layout and data, identifies the journal */
+static uint64_t image_hash(const struct image *img)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (int i = 0; i < img->count; i++) {
+		const struct image_region *r = &img->regions[i];
+		uint32_t hdr[2] = { r->addr, r->size };
+		for (unsigned j = 0; j < sizeof(hdr); j++)
+			h = (h ^ ((uint8_t *)hdr)[j]) * 0x100000001b3ULL;
+		for (uint32_t j = 0; j < r->size; j++)
+			h = (h ^ r->data[j]) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static void journal_record(FILE *jf, char type, uint32_t addr)
+{
+	fprintf(jf, "%c 0x%06X\n", type, addr);
+	fflush(jf);
+#ifndef _WIN32
+	fsync(fileno(jf));
+#endif
+}
+
+/* Reads the block states from an existing journal into "state", indexed by
+ * 64kB block number. A missing or empty journal records nothing done.
+ * Returns 1 if the journal is for a different image. */
+static int journal_load(const char *filename, uint64_t hash, uint8_t *state, uint32_t nblocks)
+{
+	FILE *jf = fopen(filename, "r");
+	unsigned long long jhash;
+	char type;
+	unsigned addr;
+	int n;
+
+	if (!jf)
+		return 0;
+	n = fscanf(jf, "iceprog journal %llx\n", &jhash);
+	if (n == EOF) {
+		fclose(jf);
+		return 0;
+	}
+	if (n != 1 || jhash != hash) {
+		fclose(jf);
+		return 1;
+	}
+	while (fscanf(jf, " %c %x", &type, &addr) == 2) {
+		if ((addr >> 16) >= nblocks)
+			continue;
+		if (type == 'E' && !state[addr >> 16])
+			state[addr >> 16] = JOURNAL_ERASED;
+		else if (type == 'P')
+			state[addr >> 16] = JOURNAL_PROGRAMMED;
+	}
+	fclose(jf);
+	return 0;
+}
+
+/* Erases and programs the image one 64kB block at a time, recording the
+ * finished steps in the journal file. When resuming, completed blocks are
+ * skipped after checking the last one recorded. */
+static void flash_write_journal(const struct image *img, const char *filename, bool resume)
+{
+	uint64_t hash = image_hash(img);
+	uint32_t nblocks = 0;
+	uint8_t *state;
+	FILE *jf;
+
+	for (int i = 0; i < img->count; i++) {
+		const struct image_region *r = &img->regions[i];
+		if (((r->addr + r->size + 0xffff) >> 16) > nblocks)
+			nblocks = (r->addr + r->size + 0xffff) >> 16;
+	}
+	state = calloc(nblocks + 1, 1);
+	if (!state) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (resume) {
+		if (journal_load(filename, hash, state, nblocks)) {
+			fprintf(stderr, "journal '%s' is for a different image, can't resume\n", filename);
+			exit(EXIT_FAILURE);
+		}
+		/* The last programmed block could be incomplete if the
+		   journal write was lost, so check it again. */
+		for (uint32_t b = nblocks; b-- > 0; ) {
+			if (state[b] == JOURNAL_PROGRAMMED) {
+				if (!flash_check_range(img, b << 16, (b + 1) << 16)) {
+					fprintf(stderr, "block 0x%06X incomplete, writing again\n", b << 16);
+					state[b] = 0;
+				}
+				break;
+			}
+		}
+		jf = fopen(filename, "a");
+	} else {
+		jf = fopen(filename, "w");
+	}
+	/* A new or empty journal starts with the image hash */
+	if (jf && !fseek(jf, 0, SEEK_END) && ftell(jf) == 0)
+		fprintf(jf, "iceprog journal %016llx\n", (unsigned long long)hash);
+	if (!jf) {
+		fprintf(stderr, "can't open journal '%s': %s\n", filename, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t b = 0; b < nblocks; b++) {
+		uint32_t addr = b << 16;
+		bool used = false;
+
+		for (int i = 0; i < img->count; i++)
+			if (img->regions[i].addr < addr + 0x10000 &&
+			    img->regions[i].addr + img->regions[i].size > addr)
+				used = true;
+		if (!used)
+			continue;
+
+		if (state[b] == JOURNAL_PROGRAMMED) {
+			log_printf(LOG_DEBUG, "block 0x%06X already written\n", addr);
+			continue;
+		}
+		if (state[b] != JOURNAL_ERASED) {
+			if (!skip_blank || !flash_is_blank(addr, 0x10000)) {
+				flash_write_enable();
+				flash_64kB_sector_erase(addr);
+				flash_wait();
+			}
+			journal_record(jf, 'E', addr);
+		}
+		flash_prog_range(img, addr, addr + 0x10000);
+		journal_record(jf, 'P', addr);
+	}
+
+	fclose(jf);
+	free(state);
+}
+
+// ---------------------------------------------------------
+// Streaming dump
+// ---------------------------------------------------------
+
+#define DUMP_BUFFERS 4
+#define DUMP_CHUNK   0x10000
+
+/* Ring of buffers between the flash reader and the output writer */
+struct dump_ring {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint8_t *buf[DUMP_BUFFERS];
+	uint32_t len[DUMP_BUFFERS];
+	int filled;		/* buffers ready to be written */
+	int head;		/* next buffer to fill */
+	bool done;
+	bool error;
+	FILE *f;
+	uint32_t crc;
+	struct sha256_ctx sha;
+};
+
+/* Writer thread: hashes and writes the buffers to the output file */
+static void *dump_writer(void *arg)
+{
+	struct dump_ring *ring = arg;
+	int tail = 0;
+
+	while (true) {
+		pthread_mutex_lock(&ring->lock);
+		while (!ring->filled && !ring->done)
+			pthread_cond_wait(&ring->cond, &ring->lock);
+		if (!ring->filled) {
+			pthread_mutex_unlock(&ring->lock);
+			break;
+		}
+		pthread_mutex_unlock(&ring->lock);
+
+		ring->crc = crc32_update(ring->crc, ring->buf[tail], ring->len[tail]);
+		sha256_update(&ring->sha, ring->buf[tail], ring->len[tail]);
+		if (fwrite(ring->buf[tail], 1, ring->len[tail], ring->f) != ring->len[tail])
+			ring->error = true;
+		tail = (tail + 1) % DUMP_BUFFERS;
+
+		pthread_mutex_lock(&ring->lock);
+		ring->filled--;
+		pthread_cond_signal(&ring->cond);
+		pthread_mutex_unlock(&ring->lock);
+	}
+	return NULL;
+}
+
+/* Reads "size" bytes from flash into the file, overlapping the serial
+ * reception with the hashing and writing of the previous buffers. Prints
+ * the CRC32 and SHA-256 of the data at the end. */
+static void flash_read_to_file(FILE *f, uint32_t addr, uint32_t size)
+{
+	static struct dump_ring ring;
+	pthread_t writer;
+	uint8_t digest[32];
+
+	memset(&ring, 0, sizeof(ring));
+	pthread_mutex_init(&ring.lock, NULL);
+	pthread_cond_init(&ring.cond, NULL);
+	ring.f = f;
+	sha256_init(&ring.sha);
+	for (int i = 0; i < DUMP_BUFFERS; i++) {
+		ring.buf[i] = malloc(DUMP_CHUNK);
+		if (!ring.buf[i]) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (pthread_create(&writer, NULL, dump_writer, &ring)) {
+		fprintf(stderr, "can't create writer thread\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t pos = 0; pos < size; pos += DUMP_CHUNK) {
+		uint32_t n = size - pos > DUMP_CHUNK ? DUMP_CHUNK : size - pos;
+
+		pthread_mutex_lock(&ring.lock);
+		while (ring.filled == DUMP_BUFFERS)
+			pthread_cond_wait(&ring.cond, &ring.lock);
+		pthread_mutex_unlock(&ring.lock);
+
+		flash_read_fast(addr + pos, ring.buf[ring.head], n);
+		ring.len[ring.head] = n;
+		ring.head = (ring.head + 1) % DUMP_BUFFERS;
+
+		pthread_mutex_lock(&ring.lock);
+		ring.filled++;
+		pthread_cond_signal(&ring.cond);
+		pthread_mutex_unlock(&ring.lock);
+	}
+
+	pthread_mutex_lock(&ring.lock);
+	ring.done = true;
+	pthread_cond_signal(&ring.cond);
+	pthread_mutex_unlock(&ring.lock);
+	pthread_join(writer, NULL);
+
+	for (int i = 0; i < DUMP_BUFFERS; i++)
+		free(ring.buf[i]);
+	pthread_mutex_destroy(&ring.lock);
+	pthread_cond_destroy(&ring.cond);
+
+	if (ring.error || fflush(f)) {
+		fprintf(stderr, "error writing output file: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	sha256_final(&ring.sha, digest);
+	fprintf(stderr, "CRC32: %08X\nSHA-256: ", ring.crc);
+	for (int i = 0; i < 32; i++)
+		fprintf(stderr, "%02x", digest[i]);
+	fprintf(stderr, "\n");
+}
+
+// ---------------------------------------------------------
+// Operation planner
+// ---------------------------------------------------------
+
+enum step_type {
+	STEP_ID,
+	STEP_UNPROTECT,
+	STEP_BULK_ERASE,
+	STEP_ERASE_64K,
+	STEP_ERASE_4K,
+	STEP_PROGRAM,
+	STEP_VERIFY,
+	STEP_READ,
+	STEP_PROG_VERIFY,
+};
+
+static const char *step_names[] = {
+	"read id", "unprotect", "bulk erase", "erase 64kB", "erase 4kB", "program", "verify", "read",
+	"prog+verify"
+};
+
+struct plan_step {
+	enum step_type type;
+	uint32_t addr;
+	uint32_t size;
+};
+
+/* List of flash operations, executed in order */
+struct plan {
+	struct plan_step *steps;
+	int count;
+	const struct image *img;	/* data for program and verify steps */
+	FILE *f;			/* output for read steps */
+};
+
+/* Link and bus speeds used to estimate the duration of a plan */
+struct plan_cost {
+	double link_rate;	/* bytes per second over the link */
+	double rtt;		/* command round trip time, in seconds */
+	double spi_rate;	/* bytes per second on the SPI bus */
+};
+
+static void plan_add(struct plan *p, enum step_type type, uint32_t addr, uint32_t size)
+{
+	struct plan_step *steps = realloc(p->steps, (p->count + 1) * sizeof(*steps));
+	if (!steps) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	p->steps = steps;
+	steps[p->count].type = type;
+	steps[p->count].addr = addr;
+	steps[p->count].size = size;
+	p->count++;
+}
+
+/* Adds one step for each region of the image */
+static void plan_image(struct plan *p, enum step_type type, const struct image *img)
+{
+	for (int i = 0; i < img->count; i++)
+		plan_add(p, type, img->regions[i].addr, img->regions[i].size);
+}
+
+/* Adds the steps to program and verify the image, in one pass with
+ * --inline-verify */
+static void plan_write(struct plan *p, const struct image *img)
+{
+	if (inline_verify)
+		plan_image(p, STEP_PROG_VERIFY, img);
+	else {
+		plan_image(p, STEP_PROGRAM, img);
+		plan_image(p, STEP_VERIFY, img);
+	}
+}
+
+/* Adds the steps to erase all the flash touched by the image. For each 64kB
+ * block, uses one block erase or 4kB sector erases, whichever is faster. */
+static void plan_erase(struct plan *p, const struct image *img)
+{
+	uint32_t last_block = 0xffffffff;
+
+	for (int i = 0; i < img->count; i++) {
+		const struct image_region *r = &img->regions[i];
+		for (uint32_t blk = r->addr & ~0xffff; blk < r->addr + r->size; blk += 0x10000) {
+			int sectors = 0;
+
+			if (blk == last_block)
+				continue;
+			last_block = blk;
+
+			for (uint32_t addr = blk; addr < blk + 0x10000; addr += 0x1000)
+				if (image_read(img, addr, NULL, 0x1000))
+					sectors++;
+
+			if (sectors * T_ERASE_4K >= T_ERASE_64K) {
+				plan_add(p, STEP_ERASE_64K, blk, 0x10000);
+				continue;
+			}
+			for (uint32_t addr = blk; addr < blk + 0x10000; addr += 0x1000)
+				if (image_read(img, addr, NULL, 0x1000))
+					plan_add(p, STEP_ERASE_4K, addr, 0x1000);
+		}
+	}
+}
+
+/* Estimated duration of one step */
+static double plan_step_time(const struct plan_step *s, const struct plan_cost *c)
+{
+	double pages = (s->size + 255) / 256;
+
+	switch (s->type) {
+	case STEP_ID:
+		return 2 * c->rtt;
+	case STEP_UNPROTECT:
+		return 3 * c->rtt + T_WRITE_SR;
+	case STEP_BULK_ERASE:
+		return 2 * c->rtt + T_ERASE_CHIP;
+	case STEP_ERASE_64K:
+		return 3 * c->rtt + T_ERASE_64K;
+	case STEP_ERASE_4K:
+		return 3 * c->rtt + T_ERASE_4K;
+	case STEP_PROGRAM:
+		/* One round trip to send the page, then poll until done */
+		return pages * (c->rtt + (c->rtt > T_PAGE_PROG ? c->rtt : T_PAGE_PROG) + 30 / c->link_rate) +
+		       s->size / c->link_rate + s->size / c->spi_rate;
+	case STEP_VERIFY:
+	case STEP_READ:
+		return (s->size / FAST_READ_MAX + 1) * c->rtt + s->size / c->link_rate + s->size / c->spi_rate;
+	case STEP_PROG_VERIFY:
+		/* Each page is read back with the program command of the next */
+		return pages * (c->rtt + (c->rtt > T_PAGE_PROG ? c->rtt : T_PAGE_PROG) + 35 / c->link_rate) +
+		       c->rtt + 2 * s->size / c->link_rate + 2 * s->size / c->spi_rate;
+	}
+	return 0;
+}
+
+static double plan_time(const struct plan *p, const struct plan_cost *c)
+{
+	double t = 0;
+	for (int i = 0; i < p->count; i++)
+		t += plan_step_time(&p->steps[i], c);
+	return t;
+}
+
+static void plan_print(const struct plan *p, const struct plan_cost *c)
+{
+	for (int i = 0; i < p->count; i++) {
+		const struct plan_step *s = &p->steps[i];
+		fprintf(stderr, "  %-11s", step_names[s->type]);
+		if (s->size)
+			fprintf(stderr, " 0x%06X +0x%06X", s->addr, s->size);
+		else
+			fprintf(stderr, "%18s", "");
+		fprintf(stderr, " %10.3f s\n", plan_step_time(s, c));
+	}
+	fprintf(stderr, "estimated time: %.3f s (link %.1f kB/s, round trip %.3f ms, SPI %.1f kB/s)\n",
+		plan_time(p, c), 0.001 * c->link_rate, 1000 * c->rtt, 0.001 * c->spi_rate);
+}
+
+static void plan_execute(const struct plan *p)
+{
+	bool programming = false, reading = false, verified = false;
+
+	for (int i = 0; i < p->count; i++) {
+		const struct plan_step *s = &p->steps[i];
+		if (flash_size && (uint64_t)s->addr + s->size > flash_size) {
+			fprintf(stderr, "%s 0x%06X +0x%06X is beyond the end of the flash (%u kB)\n",
+				step_names[s->type], s->addr, s->size, flash_size / 1024);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (int i = 0; i < p->count; i++) {
+		const struct plan_step *s = &p->steps[i];
+		switch (s->type) {
+		case STEP_ID:
+			flash_read_id();
+			break;
+		case STEP_UNPROTECT:
+			flash_write_enable();
+			flash_disable_protection();
+			break;
+		case STEP_BULK_ERASE:
+			flash_write_enable();
+			flash_bulk_erase();
+			flash_wait();
+			break;
+		case STEP_ERASE_64K:
+		case STEP_ERASE_4K:
+			if (skip_blank && flash_is_blank(s->addr, s->size)) {
+				fprintf(stderr, "%s sector at 0x%06X already blank..\n",
+					s->type == STEP_ERASE_64K ? "64kB" : "4kB", s->addr);
+				break;
+			}
+			flash_write_enable();
+			if (s->type == STEP_ERASE_64K)
+				flash_64kB_sector_erase(s->addr);
+			else
+				flash_4kB_sector_erase(s->addr);
+			if (log_enabled(LOG_TRACE)) {
+				log_printf(LOG_TRACE, "Status after block erase:\n");
+				flash_read_status();
+			}
+			flash_wait();
+			break;
+		case STEP_PROGRAM:
+			if (!programming)
+				fprintf(stderr, "programming..\n");
+			programming = true;
+			flash_prog_range(p->img, s->addr, s->addr + s->size);
+			break;
+		case STEP_VERIFY:
+			if (!reading)
+				fprintf(stderr, "reading..\n");
+			reading = verified = true;
+			if (repair ? !flash_verify_repair(p->img, s->addr, s->addr + s->size) :
+			    !flash_check_range(p->img, s->addr, s->addr + s->size)) {
+				fprintf(stderr, "Found difference between flash and file!\n");
+				exit(3);
+			}
+			break;
+		case STEP_PROG_VERIFY: {
+			uint32_t bad;
+			if (!programming)
+				fprintf(stderr, "programming and verifying..\n");
+			programming = verified = true;
+			if (!flash_prog_verify_range(p->img, s->addr, s->addr + s->size, &bad)) {
+				fprintf(stderr, "Found difference between flash and file at 0x%06X!\n", bad);
+				exit(3);
+			}
+			break;
+		}
+		case STEP_READ:
+			if (!reading)
+				fprintf(stderr, "reading..\n");
+			reading = true;
+			flash_read_to_file(p->f, s->addr, s->size);
+			break;
+		}
+	}
+	if (verified)
+		fprintf(stderr, "VERIFY OK\n");
+}
+
+// ---------------------------------------------------------
+// A/B warm boot slots
+// ---------------------------------------------------------
+
+/* Largest bitstream looked for when the flash has no A/B header yet, the
+ * biggest iCE40 bitstream is 135100 bytes */
+#define AB_IMAGE_MAX 0x40000
+
+/* Erases, writes and verifies "slot_img" */
+static void ab_write(const struct image *slot_img)
+{
+	struct plan plan = { NULL, 0, slot_img, NULL };
+
+	plan_erase(&plan, slot_img);
+	plan_write(&plan, slot_img);
+	plan_execute(&plan);
+	free(plan.steps);
+}
+
+/* Rewrites the warm boot header to boot "addr", with "fallback" as warm
+ * boot image 1 */
+static void ab_switch(uint32_t addr, uint32_t fallback)
+{
+	uint8_t header[WARMBOOT_HEADER_SIZE];
+	uint32_t boot[WARMBOOT_ENTRIES];
+	struct image header_img = { NULL, 0 };
+	struct plan plan = { NULL, 0, &header_img, NULL };
+
+	boot[0] = boot[1] = boot[3] = boot[4] = addr;
+	boot[2] = fallback;
+	bitstream_warmboot_header(header, boot);
+	if (image_add(&header_img, 0, header, sizeof(header)))
+		exit(EXIT_FAILURE);
+	plan_add(&plan, STEP_ERASE_4K, 0, 0x1000);
+	plan_write(&plan, &header_img);
+	plan_execute(&plan);
+	free(plan.steps);
+	image_free(&header_img);
+}
+
+/* Without an A/B header, makes slot B boot the image the flash boots now,
+ * copying it there first, so slot A can then be written over the old image.
+ * Returns 0 if the flash has no valid image to keep. */
+static int ab_keep_current(const uint8_t *header, uint32_t addr)
+{
+	struct image copy_img = { NULL, 0 };
+	struct bitstream_info info;
+	uint32_t old = 0, size = AB_IMAGE_MAX;
+	uint8_t *data;
+
+	// A header from another layout boots an image elsewhere
+	if (bitstream_parse(header, 32, NULL, &info) == BITSTREAM_OK && info.reboot)
+		old = info.boot_addr;
+	if (flash_size && old < flash_size && size > flash_size - old)
+		size = flash_size - old;
+	data = malloc(size);
+	if (!data) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	flash_read_fast(old, data, size);
+	if (bitstream_parse(data, size, NULL, &info) != BITSTREAM_OK || info.reboot) {
+		free(data);
+		return 0;
+	}
+
+	if (old != addr) {
+		// The erase of slot B works on whole 64kB blocks
+		if (addr < old + info.end && old < addr + ((info.end + 0xffff) & ~0xffff)) {
+			fprintf(stderr, "slot B at 0x%06X overlaps the image booted now (0x%06X-0x%06X), "
+				"can't keep it as fallback\n", addr, old, old + info.end - 1);
+			exit(EXIT_FAILURE);
+		}
+		fprintf(stderr, "copying the image at 0x%06X to slot B..\n", old);
+		if (image_add(&copy_img, addr, data, info.end))
+			exit(EXIT_FAILURE);
+		ab_write(&copy_img);
+		image_free(&copy_img);
+	}
+	fprintf(stderr, "switching boot header to slot B..\n");
+	ab_switch(addr, addr);
+	free(data);
+	return 1;
+}
+
+/* Writes the image into the slot the warm boot header at address 0 doesn't
+ * boot from, verifies it, and only then rewrites the header to boot the new
+ * slot. The previous image stays available as warm boot image 1. Without an
+ * A/B header, the image the flash boots is first moved to slot B and booted
+ * from there, so it is never erased while it is the only one bootable. */
+static void flash_write_ab(const struct image *img, const uint32_t slot[2])
+{
+	uint8_t header[WARMBOOT_HEADER_SIZE];
+	struct image slot_img = { NULL, 0 };
+	struct bitstream_info info;
+	int active = -1, target;
+
+	flash_read_fast(0, header, sizeof(header));
+	if (bitstream_parse(header, 32, NULL, &info) == BITSTREAM_OK && info.reboot) {
+		if (info.boot_addr == slot[0])
+			active = 0;
+		else if (info.boot_addr == slot[1])
+			active = 1;
+	}
+	if (active < 0) {
+		fprintf(stderr, "no A/B boot header found\n");
+		if (ab_keep_current(header, slot[1]))
+			active = 1;
+	}
+	target = active == 0 ? 1 : 0;
+
+	// Write and verify the image in the inactive slot, on a flash without
+	// any valid image in both slots
+	if (active < 0) {
+		fprintf(stderr, "no image to fall back to, writing the image to both slots\n");
+		for (int i = 0; i < img->count; i++)
+			if (image_add(&slot_img, img->regions[i].addr + slot[1],
+				      img->regions[i].data, img->regions[i].size))
+				exit(EXIT_FAILURE);
+	} else
+		fprintf(stderr, "booting slot %c, writing slot %c at 0x%06X\n",
+			'A' + active, 'A' + target, slot[target]);
+	for (int i = 0; i < img->count; i++)
+		if (image_add(&slot_img, img->regions[i].addr + slot[target],
+			      img->regions[i].data, img->regions[i].size))
+			exit(EXIT_FAILURE);
+	if (image_finish(&slot_img))
+		exit(EXIT_FAILURE);
+	ab_write(&slot_img);
+	image_free(&slot_img);
+
+	// Switch the header to the new slot, keeping the old one as fallback
+	fprintf(stderr, "switching boot header to slot %c..\n", 'A' + target);
+	ab_switch(slot[target], slot[target ^ 1]);
+}
+
+// ---------------------------------------------------------
+// SRAM configuration
+// ---------------------------------------------------------
+
+/* Largest SPI operation used to stream the bitstream, and the bytes an
+ * S_CMD_O_SPIOP command adds before its data */
+#define SRAM_CHUNK_MAX 0x10000
+#define SRAM_SPIOP_HEADER 7
+
+static void sram_gpio(uint8_t state)
+{
+	if (serprog_set_gpio(state))
+		exit(2);
+}
+
+/* Configures the FPGA directly in SPI slave mode, streaming the bitstream
+ * with the chip select held low between the SPI operations */
+static void fpga_prog_sram(const struct image *img, int timeout_ms)
+{
+	struct serprog_caps caps;
+	uint8_t dummy[7] = { 0 };
+	uint32_t chunk = SRAM_CHUNK_MAX;
+
+	// Each SPI operation must fit in the programmer serial buffer, 16 bytes
+	// when it isn't reported
+	serprog_get_caps(&caps);
+	if (caps.serbuf < 16)
+		caps.serbuf = 16;
+	if (caps.serbuf - SRAM_SPIOP_HEADER < chunk)
+		chunk = caps.serbuf - SRAM_SPIOP_HEADER;
+
+	// Chip select low while CRESET rises selects the SPI slave mode
+	fprintf(stderr, "reset..\n");
+	sram_gpio(SERPROG_GPIO_CS_LOW);
+	usleep(100);
+	sram_gpio(SERPROG_GPIO_CRESET | SERPROG_GPIO_CS_LOW);
+	usleep(2000);
+
+	fprintf(stderr, "cdone: %s\n", get_cdone() ? "high" : "low");
+
+	// 8 clocks with chip select high, then the bitstream
+	fprintf(stderr, "programming..\n");
+	sram_gpio(SERPROG_GPIO_CRESET | SERPROG_GPIO_CS_HIGH);
+	send_spi(dummy, 1);
+	sram_gpio(SERPROG_GPIO_CRESET | SERPROG_GPIO_CS_LOW);
+	for (int i = 0; i < img->count; i++) {
+		const struct image_region *r = &img->regions[i];
+		for (uint32_t pos = 0, n; pos < r->size; pos += n) {
+			n = r->size - pos > chunk ? chunk : r->size - pos;
+			queue_spi(r->data + pos, n, NULL, 0);
+		}
+	}
+	flush_spi();
+
+	// At least 49 more clocks with chip select high start the FPGA
+	sram_gpio(SERPROG_GPIO_CRESET | SERPROG_GPIO_CS_HIGH);
+	send_spi(dummy, sizeof(dummy));
+	sram_gpio(SERPROG_GPIO_CRESET);
+
+	fpga_report_cdone(timeout_ms, true);
+}
+
+// ---------------------------------------------------------
+// iceprog implementation
+// ---------------------------------------------------------
+
+/* Parses a size or offset with optional `k' or `M' suffix */
+static int parse_size(const char *arg, uint32_t *size)
+{
+	char *endptr;
+	unsigned long long val = strtoull(arg, &endptr, 0);
+
+	if (endptr == arg || *arg == '-')
+		return 1;
+	if (!strcmp(endptr, "k"))
+		val *= 1024;
+	else if (!strcmp(endptr, "M"))
+		val *= 1024 * 1024;
+	else if (*endptr != '\0')
+		return 1;
+	if (val > 0xffffffff)
+		return 1;
+	*size = val;
+	return 0;
+}
+
+/* Loads an input file at "offset". iCE40 bitstreams are checked, and the
+ * filler after the wakeup command is dropped, unless "raw_input" is set. */
+static int load_input(struct image *img, const char *name, uint32_t offset)
+{
+	struct image file = { NULL, 0 };
+	int ret = 0;
+
+	if (image_load(&file, name, offset))
+		return 1;
+
+	for (int i = 0; i < file.count && !ret; i++) {
+		struct image_region *r = &file.regions[i];
+		struct bitstream_info info;
+
+		if (!raw_input) {
+			int res = bitstream_parse(r->data, r->size, name, &info);
+			if (res == BITSTREAM_BAD) {
+				fprintf(stderr, "use `--raw' to write it anyway\n");
+				ret = 1;
+				break;
+			}
+			if (res == BITSTREAM_OK && !info.reboot && info.end < r->size) {
+				// Only padding is dropped, data after the bitstream is kept
+				bool filler = true;
+				for (uint32_t j = info.end + 1; j < r->size && filler; j++)
+					filler = r->data[j] == r->data[info.end];
+				if (filler && (r->data[info.end] == 0xff || r->data[info.end] == 0x00)) {
+					fprintf(stderr, "%s: iCE40 bitstream, %u CRAM and %u BRAM banks, "
+						"dropping %u bytes of filler\n", name, info.cram, info.bram,
+						r->size - info.end);
+					r->size = info.end;
+				} else
+					fprintf(stderr, "%s: iCE40 bitstream, %u CRAM and %u BRAM banks, "
+						"keeping the %u bytes of data after it\n", name, info.cram, info.bram,
+						r->size - info.end);
+			}
+		}
+		ret = image_add(img, r->addr, r->data, r->size);
+	}
+	image_free(&file);
+	return ret;
+}
+
+/* Baud rates tried in auto mode, fastest first */
+static const int auto_baud_rates[] = {
+	4000000, 3000000, 2000000, 1500000, 1000000, 921600, 460800, 230400, 115200, 0
+};
+
+/* Try all baud rates from the list, keeps the first one that works.
+ * Returns -1 if the link has no baud rate, 0 if no rate works. */
+static int serial_auto_baud(const char *devstr)
+{
+	if (serialport_open(devstr, auto_baud_rates[0]))
+		return 0;
+
+	for (int i = 0; auto_baud_rates[i]; i++) {
+		int baud = auto_baud_rates[i];
+		int ret;
+		log_printf(LOG_DEBUG, "trying %d baud..\n", baud);
+		ret = serialport_set_baud(baud);
+		if (ret > 0)
+			continue;
+		if (!serprog_sync())
+			return ret < 0 ? -1 : baud;
+		if (ret < 0)
+			break;
+	}
+	serialport_close();
+	return 0;
+}
+
+static void print_stats(int baud)
+{
+	struct serprog_stats st;
+	serprog_get_stats(&st);
+
+	fprintf(stderr, "link: %lu commands, %lu bytes sent (%lu bytes SPI payload",
+		st.commands, st.tx_bytes, st.payload_bytes);
+	if (st.compressed)
+		fprintf(stderr, ", %lu ops compressed", st.compressed);
+	fprintf(stderr, "), %lu bytes received\n", st.rx_bytes);
+	if (st.io_time > 0) {
+		fprintf(stderr, "link: ");
+		if (baud)
+			fprintf(stderr, "%d baud, ", baud);
+		fprintf(stderr, "%.3f s waiting, %.1f kB/s\n", st.io_time,
+			0.001 * (st.tx_bytes + st.rx_bytes) / st.io_time);
+	}
+	if (st.retries)
+		fprintf(stderr, "link: %lu retries, %.3f s lost recovering from errors\n",
+			st.retries, st.retry_time);
+}
+
+// ---------------------------------------------------------
+// Job files
+// ---------------------------------------------------------
+
+enum job_type {
+	JOB_ID,
+	JOB_READ,
+	JOB_WRITE,
+	JOB_VERIFY,
+	JOB_ERASE,
+	JOB_BULK_ERASE,
+	JOB_UNPROTECT,
+};
+
+struct job {
+	enum job_type type;
+	int line;
+	struct image img;	/* data for write and verify */
+	FILE *f;		/* output for read */
+	uint32_t offset, size;	/* range for read and erase */
+};
+
+static const char *job_names[] = {
+	"id", "read", "write", "verify", "erase", "bulk-erase", "unprotect"
+};
+
+/* Parses a job file, one operation per line:
+ *   id
+ *   read <file> <offset> <size>
+ *   write <file>[@<offset>]...
+ *   verify <file>[@<offset>]...
+ *   erase <offset> <size>
+ *   bulk-erase
+ *   unprotect
+ * All files are opened and loaded in advance, so errors are detected before
+ * touching the hardware. Returns the number of jobs, or -1 on error. */
+static int load_jobs(const char *filename, struct job **jobs)
+{
+	FILE *f = (strcmp(filename, "-") == 0) ? stdin : fopen(filename, "r");
+	char line[4096];
+	int count = 0, lnum = 0;
+
+	if (f == NULL) {
+		fprintf(stderr, "can't open '%s' for reading: %s\n", filename, strerror(errno));
+		return -1;
+	}
+
+	*jobs = NULL;
+	while (fgets(line, sizeof(line), f)) {
+		char *words[64];
+		int nw = 0;
+		struct job job;
+
+		lnum++;
+		for (char *w = strtok(line, " \t\r\n"); w && nw < 64; w = strtok(NULL, " \t\r\n"))
+			words[nw++] = w;
+		if (!nw || words[0][0] == '#')
+			continue;
+
+		memset(&job, 0, sizeof(job));
+		job.line = lnum;
+		job.type = JOB_UNPROTECT + 1;
+		for (int i = 0; i <= JOB_UNPROTECT; i++)
+			if (!strcmp(words[0], job_names[i]))
+				job.type = i;
+
+		switch (job.type) {
+		case JOB_ID:
+		case JOB_BULK_ERASE:
+		case JOB_UNPROTECT:
+			if (nw != 1)
+				goto bad;
+			break;
+		case JOB_READ:
+			if (nw != 4 || parse_size(words[2], &job.offset) || parse_size(words[3], &job.size))
+				goto bad;
+			job.f = (strcmp(words[1], "-") == 0) ? stdout : fopen(words[1], "wb");
+			if (job.f == NULL) {
+				fprintf(stderr, "can't open '%s' for writing: %s\n", words[1], strerror(errno));
+				goto bad;
+			}
+			break;
+		case JOB_ERASE:
+			if (nw != 3 || parse_size(words[1], &job.offset) || parse_size(words[2], &job.size))
+				goto bad;
+			break;
+		case JOB_WRITE:
+		case JOB_VERIFY:
+			if (nw < 2)
+				goto bad;
+			for (int i = 1; i < nw; i++) {
+				uint32_t offset = 0;
+				char *at = strrchr(words[i], '@');
+				if (at && at != words[i] && !parse_size(at + 1, &offset))
+					*at = 0;
+				if (load_input(&job.img, words[i], offset))
+					goto bad;
+			}
+			if (image_finish(&job.img))
+				goto bad;
+			break;
+		default:
+			goto bad;
+		}
+
+		struct job *nj = realloc(*jobs, (count + 1) * sizeof(*nj));
+		if (!nj) {
+			fprintf(stderr, "out of memory\n");
+			goto err;
+		}
+		*jobs = nj;
+		nj[count++] = job;
+	}
+	if (f != stdin)
+		fclose(f);
+	return count;
+
+bad:
+	fprintf(stderr, "%s:%d: invalid job\n", filename, lnum);
+err:
+	if (f != stdin)
+		fclose(f);
+	return -1;
+}
+
+/* Builds the plan of operations of one job */
+static void job_plan(struct job *job, struct plan *p)
+{
+	p->img = &job->img;
+	p->f = job->f;
+	switch (job->type) {
+	case JOB_ID:
+		plan_add(p, STEP_ID, 0, 0);
+		break;
+	case JOB_READ:
+		plan_add(p, STEP_READ, job->offset, job->size);
+		break;
+	case JOB_WRITE:
+		plan_erase(p, &job->img);
+		plan_write(p, &job->img);
+		break;
+	case JOB_VERIFY:
+		plan_image(p, STEP_VERIFY, &job->img);
+		break;
+	case JOB_ERASE: {
+		struct image_region r = { job->offset, job->size, NULL };
+		struct image erase_img = { &r, 1 };
+		plan_erase(p, &erase_img);
+		break;
+	}
+	case JOB_BULK_ERASE:
+		plan_add(p, STEP_BULK_ERASE, 0, 0);
+		break;
+	case JOB_UNPROTECT:
+		plan_add(p, STEP_UNPROTECT, 0, 0);
+		break;
+	}
+}
+
+/* Prints the plan of all the jobs, with the estimated times */
+static void print_jobs(struct job *jobs, int count, const struct plan_cost *cost)
+{
+	double total = 0;
+
+	for (int i = 0; i < count; i++) {
+		struct plan plan = { NULL, 0, NULL, NULL };
+		job_plan(&jobs[i], &plan);
+		fprintf(stderr, "job %d: %s\n", i + 1, job_names[jobs[i].type]);
+		plan_print(&plan, cost);
+		total += plan_time(&plan, cost);
+		free(plan.steps);
+	}
+	fprintf(stderr, "%d jobs, estimated time: %.3f s\n", count, total);
+}
+
+/* Runs all the jobs in the current session, reporting the time of each */
+static void run_jobs(struct job *jobs, int count, const struct plan_cost *cost)
+{
+	double start = get_time(), estimate = 0;
+
+	for (int i = 0; i < count; i++) {
+		struct job *job = &jobs[i];
+		struct plan plan = { NULL, 0, NULL, NULL };
+		double job_start = get_time();
+
+		job_plan(job, &plan);
+		estimate += plan_time(&plan, cost);
+		fprintf(stderr, "job %d: %s, estimated %.3f s\n", i + 1, job_names[job->type],
+			plan_time(&plan, cost));
+		if (log_enabled(LOG_DEBUG))
+			plan_print(&plan, cost);
+		plan_execute(&plan);
+		free(plan.steps);
+
+		if (job->f && job->f != stdout)
+			fclose(job->f);
+		image_free(&job->img);
+		job->f = NULL;
+		fprintf(stderr, "job %d: %s done in %.3f s\n", i + 1, job_names[job->type],
+			get_time() - job_start);
+	}
+	fprintf(stderr, "%d jobs done in %.3f s, estimated %.3f s\n", count, get_time() - start, estimate);
+}
+
+// ---------------------------------------------------------
+// Production line mode
+// ---------------------------------------------------------
+
+#ifndef _WIN32
+
+/* Maximum number of serial devices tracked */
+#define WATCH_MAX 32
+/* Attempts to probe a new device, while the programmer starts up, with
+ * a growing delay from WATCH_PROBE_DELAY microseconds */
+#define WATCH_PROBES 4
+#define WATCH_PROBE_DELAY 100000
+/* Rescans retrying a device that doesn't answer, one every second */
+#define WATCH_RETRIES 10
+/* Exit status of a child process finding no programmer on its device */
+#define WATCH_NO_PROGRAMMER 100
+
+struct watch_slot {
+	char dev[SERIAL_NAME_MAX];
+	char serial[128];
+	bool present;	// found in the last scan of the devices
+	bool done;	// programmed, or not to be programmed
+	int tries;	// failed probe rounds
+	pid_t pid;	// programming process, 0 if none
+	FILE *out;	// output of the programming process
+	double start;
+};
+
+static volatile sig_atomic_t watch_stop = 0;
+
+static void watch_signal(int sig)
+{
+	(void)sig;
+	watch_stop = 1;
+}
+
+/* Logs the result of a finished programming process, followed by its
+ * output */
+static void watch_report(FILE *log, struct watch_slot *s, int status)
+{
+	char stamp[32], result[32];
+	time_t now = time(NULL);
+	int c, bol = 1;
+
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		strcpy(result, "OK");
+	else if (WIFEXITED(status))
+		snprintf(result, sizeof(result), "FAILED (exit status %d)", WEXITSTATUS(status));
+	else
+		snprintf(result, sizeof(result), "FAILED (signal %d)", WTERMSIG(status));
+	fprintf(stderr, "%s: %s in %.3f s\n", s->dev, result, get_time() - s->start);
+	fprintf(log, "%s %s serial %s: %s in %.3f s\n", stamp, s->dev, s->serial, result,
+		get_time() - s->start);
+
+	rewind(s->out);
+	while ((c = getc(s->out)) != EOF) {
+		if (bol)
+			fputs("  ", log);
+		putc(c, log);
+		bol = c == '\n';
+	}
+	if (!bol)
+		putc('\n', log);
+	fflush(log);
+	fclose(s->out);
+	s->out = NULL;
+	s->pid = 0;
+}
+
+/* Starts programming a new device in a child process, with the output
+ * going to a temporary file. Returns true in the child process. */
+static bool watch_fork(FILE *log, struct watch_slot *s)
+{
+	if (serialport_get_serial(s->dev, s->serial, sizeof(s->serial)))
+		strcpy(s->serial, "-");
+	s->out = tmpfile();
+	if (!s->out) {
+		fprintf(stderr, "%s: can't create a temporary file: %s\n", s->dev, strerror(errno));
+		return false;
+	}
+	fflush(log);
+	fflush(stdout);
+	s->start = get_time();
+	s->pid = fork();
+	if (s->pid < 0) {
+		fprintf(stderr, "%s: can't start programming: %s\n", s->dev, strerror(errno));
+		fclose(s->out);
+		s->out = NULL;
+		s->pid = 0;
+		return false;
+	}
+	if (s->pid == 0) {
+		// Interrupting the watch lets the running boards finish
+		signal(SIGINT, SIG_IGN);
+		signal(SIGTERM, SIG_DFL);
+		dup2(fileno(s->out), STDOUT_FILENO);
+		dup2(fileno(s->out), STDERR_FILENO);
+		return true;
+	}
+	if (!s->tries)
+		fprintf(stderr, "%s: new device, serial %s..\n", s->dev, s->serial);
+	return false;
+}
+
+/* Probes the device in the child process, while the programmer starts up.
+ * Returns true if it answers. */
+static bool watch_probe(const char *dev, int baud)
+{
+	for (int k = 0; k < WATCH_PROBES; k++) {
+		if (k)
+			usleep(WATCH_PROBE_DELAY << (k - 1));
+		if (!serprog_probe(dev, baud))
+			return true;
+	}
+	return false;
+}
+
+/* Handles a device that didn't answer as a programmer, it is probed again
+ * on a later scan until WATCH_RETRIES rounds have failed */
+static void watch_unanswered(FILE *log, struct watch_slot *s)
+{
+	fclose(s->out);
+	s->out = NULL;
+	s->pid = 0;
+	s->tries++;
+	s->done = s->tries == WATCH_RETRIES;
+	fprintf(stderr, "%s: no SERPROG programmer answering (try %d of %d)%s\n", s->dev,
+		s->tries, WATCH_RETRIES, s->done ? ", ignored until plugged in again" : "");
+	if (log != stdout) {
+		fprintf(log, "%s: no SERPROG programmer answering (try %d of %d)%s\n", s->dev,
+			s->tries, WATCH_RETRIES, s->done ? ", ignored until plugged in again" : "");
+		fflush(log);
+	}
+}
+
+/* Waits for SERPROG programmers to be plugged in, and probes and programs
+ * each new one in a child process, several at a time. The results are appended to
+ * the log. Returns the device to program in the child processes; the
+ * parent exits when interrupted, after the running boards finish. */
+static const char *watch_programmers(const char *log_name, int baud)
+{
+	static struct watch_slot slots[WATCH_MAX];
+	static char list[WATCH_MAX][SERIAL_NAME_MAX];
+	int nslots = 0, running = 0;
+	FILE *log;
+
+	log = strcmp(log_name, "-") ? fopen(log_name, "a") : stdout;
+	if (!log) {
+		fprintf(stderr, "can't open '%s' for writing: %s\n", log_name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (serialport_watch_start()) {
+		fprintf(stderr, "can't watch for new serial devices\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// The devices already connected are left alone
+	nslots = serialport_list_devices(list, WATCH_MAX);
+	for (int i = 0; i < nslots; i++) {
+		strcpy(slots[i].dev, list[i]);
+		slots[i].present = slots[i].done = true;
+	}
+	signal(SIGINT, watch_signal);
+	signal(SIGTERM, watch_signal);
+	fprintf(stderr, "waiting for programmers (%d serial devices already connected)..\n", nslots);
+
+	double retry_at = 0;
+
+	while (!watch_stop || running) {
+		bool changed = serialport_watch_wait(200);
+		int status;
+		pid_t pid;
+
+		// Devices that didn't answer are probed again on a later scan
+		if (retry_at && get_time() >= retry_at) {
+			changed = true;
+			retry_at = 0;
+		}
+
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (int i = 0; i < nslots; i++) {
+				if (slots[i].pid != pid)
+					continue;
+				running--;
+				if (WIFEXITED(status) && WEXITSTATUS(status) == WATCH_NO_PROGRAMMER) {
+					watch_unanswered(log, &slots[i]);
+					if (!slots[i].done)
+						retry_at = get_time() + 1;
+				} else {
+					watch_report(log, &slots[i], status);
+					slots[i].done = true;
+				}
+			}
+		}
+
+		// Forget the unplugged devices, so they are programmed again
+		for (int i = 0; i < nslots; ) {
+			if (!slots[i].present && !slots[i].pid)
+				slots[i] = slots[--nslots];
+			else
+				i++;
+		}
+		if (!changed || watch_stop)
+			continue;
+
+		int count = serialport_list_devices(list, WATCH_MAX);
+		for (int i = 0; i < nslots; i++)
+			slots[i].present = false;
+		for (int j = 0; j < count; j++) {
+			int i = 0;
+			while (i < nslots && strcmp(slots[i].dev, list[j]))
+				i++;
+			if (i < nslots) {
+				slots[i].present = true;
+				continue;
+			}
+			if (nslots == WATCH_MAX)
+				break;
+			memset(&slots[nslots], 0, sizeof(slots[nslots]));
+			strcpy(slots[nslots].dev, list[j]);
+			slots[nslots++].present = true;
+		}
+
+		// Program the new devices, the child processes first check that
+		// they are SERPROG programmers
+		for (int i = 0; i < nslots; i++) {
+			struct watch_slot *s = &slots[i];
+
+			if (!s->present || s->done || s->pid)
+				continue;
+			if (watch_fork(log, s)) {
+				if (!watch_probe(s->dev, baud))
+					exit(WATCH_NO_PROGRAMMER);
+				return s->dev;
+			}
+			if (s->pid)
+				running++;
+		}
+	}
+
+	if (log != stdout)
+		fclose(log);
+	fprintf(stderr, "Bye.\n");
+	exit(EXIT_SUCCESS);
+}
+
+#endif
+
+static void help(const char *progname)
+{
+	fprintf(stderr, "Simple programming tool for iCE40 FPGA using SERPROG programmers.\n");
+	fprintf(stderr, "Usage: %s [-b|-n|-c] <input file>[@<offset>]...\n", progname);
+	fprintf(stderr, "       %s -r|-R<bytes> <output file>\n", progname);
+	fprintf(stderr, "       %s -S <input file>\n", progname);
+	fprintf(stderr, "       %s -t\n", progname);
+	fprintf(stderr, "       %s -j <job file>\n", progname);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "General options:\n");
+	fprintf(stderr, "  -d <device string>    use the specified serial device [default autodetect]\n");
+	fprintf(stderr, "                          (all USB serial devices are probed at once)\n");
+	fprintf(stderr, "                          (use `tcp:<host>:<port>' for network programmers)\n");
+	fprintf(stderr, "  -o <offset in bytes>  start address for read/write [default: 0]\n");
+	fprintf(stderr, "                          (append 'k' to the argument for size in kilobytes,\n");
+	fprintf(stderr, "                          or 'M' for size in megabytes)\n");
+	fprintf(stderr, "  -s                    slow SPI (50 kHz instead of 6 MHz)\n");
+	fprintf(stderr, "  --baud <rate>|auto    serial port baud rate [default: 115200]\n");
+	fprintf(stderr, "                          (`auto' selects the fastest rate that works)\n");
+	fprintf(stderr, "  --low-latency         tune the serial port for low latency\n");
+	fprintf(stderr, "  --raw                 write the input files as they are; by default iCE40\n");
+	fprintf(stderr, "                          bitstreams are checked and trailing filler dropped\n");
+	fprintf(stderr, "  --rescan              query the programmer capabilities again, instead of\n");
+	fprintf(stderr, "                          using the ones cached by USB serial number\n");
+	fprintf(stderr, "  --wait-cdone <ms>     after releasing the FPGA reset, wait up to <ms> for\n");
+	fprintf(stderr, "                          CDONE and fail if the FPGA doesn't configure\n");
+	fprintf(stderr, "                          [default: report CDONE after up to 250 ms]\n");
+	fprintf(stderr, "  -v                    verbose output, logging the flash operations\n");
+	fprintf(stderr, "                          (-vv also logs the data and status registers)\n");
+	fprintf(stderr, "  --dry-run             print the planned operations and the estimated time,\n");
+	fprintf(stderr, "                          without accessing the programmer\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Mode of operation:\n");
+	fprintf(stderr, "  [default]             write file contents to flash, then verify\n");
+	fprintf(stderr, "                          Many input files can be given, each one at the\n");
+	fprintf(stderr, "                          offset appended after a `@'. Files ending in .hex,\n");
+	fprintf(stderr, "                          .ihex or .mcs are read as Intel HEX. Only the flash\n");
+	fprintf(stderr, "                          blocks covered by data are erased and written.\n");
+	fprintf(stderr, "  -r                    read first 256 kB from flash and write to file\n");
+	fprintf(stderr, "  -R <size in bytes>    read the specified number of bytes from flash\n");
+	fprintf(stderr, "                          (append 'k' to the argument for size in kilobytes,\n");
+	fprintf(stderr, "                          or 'M' for size in megabytes)\n");
+	fprintf(stderr, "  -c                    do not write flash, only verify (`check')\n");
+	fprintf(stderr, "  --inline-verify       verify in the same pass as programming, reading each\n");
+	fprintf(stderr, "                          page back with the program command of the next one\n");
+	fprintf(stderr, "  --repair              repair the pages that fail verification, instead of\n");
+	fprintf(stderr, "                          failing: pages that only need bits cleared are\n");
+	fprintf(stderr, "                          programmed again, other pages have their 4kB sector\n");
+	fprintf(stderr, "                          erased and rewritten, keeping the data around\n");
+	fprintf(stderr, "  -S                    perform SRAM programming, needs a programmer that\n");
+	fprintf(stderr, "                          controls CRESET and CDONE\n");
+	fprintf(stderr, "  -t                    just read the flash ID sequence\n");
+	fprintf(stderr, "  --blank-check <size>  check that the specified number of bytes are erased,\n");
+	fprintf(stderr, "                          reporting all the 4kB sectors that are not blank\n");
+	fprintf(stderr, "  --watch <log file>    production line mode: load the input once, then program\n");
+	fprintf(stderr, "                          each SERPROG programmer plugged in from now on,\n");
+	fprintf(stderr, "                          several at a time, appending the results and the\n");
+	fprintf(stderr, "                          output to the log file (`-' for stdout). Ctrl-C\n");
+	fprintf(stderr, "                          stops after the running boards finish (Linux only)\n");
+	fprintf(stderr, "  -j <job file>         run all the operations listed in the file, one\n");
+	fprintf(stderr, "                          per line, in one programming session:\n");
+	fprintf(stderr, "                            id | bulk-erase | unprotect\n");
+	fprintf(stderr, "                            read <file> <offset> <size>\n");
+	fprintf(stderr, "                            write <file>[@<offset>]...\n");
+	fprintf(stderr, "                            verify <file>[@<offset>]...\n");
+	fprintf(stderr, "                            erase <offset> <size>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Erase mode (only meaningful in default mode):\n");
+	fprintf(stderr, "  [default]             erase the 64kB blocks touched by the written data,\n");
+	fprintf(stderr, "                          or only the touched 4kB sectors of a block when\n");
+	fprintf(stderr, "                          there are fewer than 4 of them. This means that\n");
+	fprintf(stderr, "                          some data after the written data (or even before\n");
+	fprintf(stderr, "                          when -o is used) may be erased as well.\n");
+	fprintf(stderr, "  -b                    bulk erase entire flash before writing\n");
+	fprintf(stderr, "  -e <size in bytes>    erase flash as if we were writing that number of bytes\n");
+	fprintf(stderr, "                          (e.g. `-e 4k' erases a single 4kB sector)\n");
+	fprintf(stderr, "  -n                    do not erase flash before writing\n");
+	fprintf(stderr, "  --skip-blank          read each 64kB block before erasing it, and skip the\n");
+	fprintf(stderr, "                          erase if it is already blank\n");
+	fprintf(stderr, "  -k                    keep the flash data around the written data, only\n");
+	fprintf(stderr, "                          erasing and writing the 4kB sectors that change\n");
+	fprintf(stderr, "  --patch <offset>:<length>:<source>\n");
+	fprintf(stderr, "                        fill a per-board field of the image (serial number,\n");
+	fprintf(stderr, "                          MAC address, calibration) before writing, from:\n");
+	fprintf(stderr, "                            counter:<file>  the number in the file, big\n");
+	fprintf(stderr, "                                            endian, then incremented\n");
+	fprintf(stderr, "                            csv:<file>[:<column>]  hex bytes from the next\n");
+	fprintf(stderr, "                                            row, tracked in <file>.next\n");
+	fprintf(stderr, "                            cmd:<command>   hex bytes output by the command\n");
+	fprintf(stderr, "                          Use with -k so boards holding the base image only\n");
+	fprintf(stderr, "                          get the sectors of the fields rewritten.\n");
+	fprintf(stderr, "  --journal <file>      record the progress of the write in the file, one\n");
+	fprintf(stderr, "                          64kB block at a time\n");
+	fprintf(stderr, "  --resume              continue an interrupted write from the journal\n");
+	fprintf(stderr, "  --ab <A>:<B>          A/B update: write the image in whichever of the slots\n");
+	fprintf(stderr, "                          at addresses A and B is not booted, verify it, then\n");
+	fprintf(stderr, "                          switch the warm boot header at address 0 to it.\n");
+	fprintf(stderr, "                          Without a header, the current image is first\n");
+	fprintf(stderr, "                          copied to slot B, which must not overlap it, and\n");
+	fprintf(stderr, "                          booted from there. A power loss while the 4kB\n");
+	fprintf(stderr, "                          header sector at address 0 is erased and written\n");
+	fprintf(stderr, "                          can still leave the board unbootable.\n");
+	fprintf(stderr, "  -p                    disable write protection before erasing or writing\n");
+	fprintf(stderr, "                          This can be useful if flash memory appears to be\n");
+	fprintf(stderr, "                          bricked and won't respond to erasing or programming.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Miscellaneous options:\n");
+	fprintf(stderr, "      --help            display this help and exit\n");
+	fprintf(stderr, "  --                    treat all remaining arguments as filenames\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Exit status:\n");
+	fprintf(stderr, "  0 on success,\n");
+	fprintf(stderr, "  1 if a non-hardware error occurred (e.g., failure to read from or\n");
+	fprintf(stderr, "    write to a file, or invoked with invalid options),\n");
+	fprintf(stderr, "  2 if communication with the hardware failed (e.g., cannot find the\n");
+	fprintf(stderr, "    iCE FTDI USB device),\n");
+	fprintf(stderr, "  3 if verification of the data failed, or the FPGA didn't configure.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Notes for iCEstick (iCE40HX-1k devel board):\n");
+	fprintf(stderr, "  An unmodified iCEstick can only be programmed via the serial flash.\n");
+	fprintf(stderr, "  Direct programming of the SRAM is not supported. For direct SRAM\n");
+	fprintf(stderr, "  programming the flash chip and one zero ohm resistor must be desoldered\n");
+	fprintf(stderr, "  and the programmer SI pin must be connected to the iCE SPI_SI pin, as shown\n");
+	fprintf(stderr, "  in this picture:\n");
+	fprintf(stderr, "  http://www.clifford.at/gallery/2014-elektronik/IMG_20141115_183838\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Notes for the iCE40-HX8K Breakout Board:\n");
+	fprintf(stderr, "  Make sure that the jumper settings on the board match the selected\n");
+	fprintf(stderr, "  mode (SRAM or FLASH). See the iCE40-HX8K user manual for details.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "If you have a bug report, please file an issue on github:\n");
+	fprintf(stderr, "  https://github.com/dmsc/iceprog-fser/issues\n");
+}
+
+int main(int argc, char **argv)
+{
+	/* used for error reporting */
+	const char *my_name = argv[0];
+	for (size_t i = 0; argv[0][i]; i++)
+		if (argv[0][i] == '/')
+			my_name = argv[0] + i + 1;
+
+	uint32_t read_size = 256 * 1024;
+	uint32_t erase_size = 0;
+	uint32_t rw_offset = 0;
+
+	bool read_mode = false;
+	bool check_mode = false;
+	bool erase_mode = false;
+	bool bulk_erase = false;
+	bool dont_erase = false;
+	bool test_mode = false;
+	bool slow_clock = false;
+	bool disable_protect = false;
+	bool keep_data = false;
+	const char *filename = NULL;
+	const char *job_file = NULL;
+	const char *devstr = NULL;
+	int baud = 115200;
+	bool low_latency = false;
+	const char *journal_file = NULL;
+	bool resume = false;
+	bool blank_mode = false;
+	bool dry_run = false;
+	bool rescan = false;
+	bool ab_mode = false;
+	bool prog_sram = false;
+	bool cdone_required = false;
+	enum log_level log_lvl = LOG_INFO;
+	const char *watch_log = NULL;
+	int cdone_timeout = 250;
+	uint32_t ab_slot[2] = { 0, 0 };
+	struct patch patches[PATCHES_MAX];
+	int patch_count = 0;
+	uint32_t blank_size = 0;
+
+	static struct option long_options[] = {
+		{"help", no_argument, NULL, -2},
+		{"baud", required_argument, NULL, -3},
+		{"low-latency", no_argument, NULL, -4},
+		{"journal", required_argument, NULL, -5},
+		{"resume", no_argument, NULL, -6},
+		{"blank-check", required_argument, NULL, -7},
+		{"skip-blank", no_argument, NULL, -8},
+		{"dry-run", no_argument, NULL, -9},
+		{"rescan", no_argument, NULL, -10},
+		{"raw", no_argument, NULL, -11},
+		{"ab", required_argument, NULL, -12},
+		{"wait-cdone", required_argument, NULL, -13},
+		{"watch", required_argument, NULL, -14},
+		{"repair", no_argument, NULL, -15},
+		{"inline-verify", no_argument, NULL, -16},
+		{"patch", required_argument, NULL, -17},
+		{NULL, 0, NULL, 0}
+	};
+
+	/* Decode command line parameters */
+	int opt;
+	char *endptr;
+	while ((opt = getopt_long(argc, argv, "d:I:rR:e:o:cbnStvspj:k", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'd': /* device string */
+			devstr = optarg;
+			break;
+		case 'r': /* Read 256 bytes to file */
+			read_mode = true;
+			break;
+		case 'R': /* Read n bytes to file */
+			read_mode = true;
+			if (parse_size(optarg, &read_size)) {
+				fprintf(stderr, "%s: `%s' is not a valid size\n", my_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'e': /* Erase blocks as if we were writing n bytes */
+			erase_mode = true;
+			if (parse_size(optarg, &erase_size)) {
+				fprintf(stderr, "%s: `%s' is not a valid size\n", my_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o': /* set address offset */
+			if (parse_size(optarg, &rw_offset)) {
+				fprintf(stderr, "%s: `%s' is not a valid offset\n", my_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'c': /* do not write just check */
+			check_mode = true;
+			break;
+		case 'b': /* bulk erase before writing */
+			bulk_erase = true;
+			break;
+		case 'n': /* do not erase before writing */
+			dont_erase = true;
+			break;
+		case 't': /* just read flash id */
+			test_mode = true;
+			break;
+		case 'S': /* configure the FPGA SRAM */
+			prog_sram = true;
+			break;
+		case 'v': /* provide verbose output, more with -vv */
+			if (log_lvl < LOG_TRACE)
+				log_lvl++;
+			break;
+		case 's': /* use slow SPI clock */
+			slow_clock = true;
+			break;
+		case 'p': /* disable flash protect before erase/write */
+			disable_protect = true;
+			break;
+		case 'k': /* keep data around written range */
+			keep_data = true;
+			break;
+		case 'j': /* run a job file */
+			job_file = optarg;
+			break;
+		case -2:
+			help(argv[0]);
+			return EXIT_SUCCESS;
+		case -3: /* serial port baud rate */
+			if (!strcmp(optarg, "auto"))
+				baud = 0;
+			else {
+				baud = strtol(optarg, &endptr, 0);
+				if (*endptr != '\0' || baud <= 0) {
+					fprintf(stderr, "%s: `%s' is not a valid baud rate\n", my_name, optarg);
+					return EXIT_FAILURE;
+				}
+			}
+			break;
+		case -4: /* tune serial port latency */
+			low_latency = true;
+			break;
+		case -5: /* write progress journal */
+			journal_file = optarg;
+			break;
+		case -6: /* resume from journal */
+			resume = true;
+			break;
+		case -7: /* check that flash is erased */
+			blank_mode = true;
+			if (parse_size(optarg, &blank_size)) {
+				fprintf(stderr, "%s: `%s' is not a valid size\n", my_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case -8: /* don't erase blank blocks */
+			skip_blank = true;
+			break;
+		case -9: /* only print the plan */
+			dry_run = true;
+			break;
+		case -10: /* don't use the capability cache */
+			rescan = true;
+			break;
+		case -11: /* don't parse bitstreams */
+			raw_input = true;
+			break;
+		case -12: { /* A/B slot update */
+			char *colon = strchr(optarg, ':');
+			ab_mode = true;
+			if (colon)
+				*colon = 0;
+			if (!colon || parse_size(optarg, &ab_slot[0]) || parse_size(colon + 1, &ab_slot[1])) {
+				fprintf(stderr, "%s: `--ab' needs two slot addresses, as in `--ab 0x10000:0x40000'\n", my_name);
+				return EXIT_FAILURE;
+			}
+			break;
+		}
+		case -13: /* wait for the FPGA to configure */
+			cdone_timeout = strtol(optarg, &endptr, 0);
+			cdone_required = true;
+			if (*endptr != '\0' || cdone_timeout <= 0 || cdone_timeout > 60000) {
+				fprintf(stderr, "%s: `%s' is not a valid timeout\n", my_name, optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case -14: /* program each programmer plugged in */
+			watch_log = optarg;
+			break;
+		case -15: /* repair what fails verification */
+			repair = true;
+			break;
+		case -16: /* verify while programming */
+			inline_verify = true;
+			break;
+		case -17: { /* per-board field */
+			struct patch *p = &patches[patch_count];
+			char *len = strchr(optarg, ':'), *src = len ? strchr(len + 1, ':') : NULL;
+			if (patch_count == PATCHES_MAX) {
+				fprintf(stderr, "%s: at most %d `--patch' fields are supported\n", my_name, PATCHES_MAX);
+				return EXIT_FAILURE;
+			}
+			if (src) {
+				*len++ = 0;
+				*src++ = 0;
+			}
+			if (!src || parse_size(optarg, &p->offset) || parse_size(len, &p->length) ||
+			    !p->length || p->length > PATCH_MAX || patch_parse_source(src, p)) {
+				fprintf(stderr, "%s: `--patch' needs <offset>:<length>:<source>, with the source\n"
+					"counter:<file>, csv:<file>[:<column>] or cmd:<command>\n", my_name);
+				return EXIT_FAILURE;
+			}
+			patch_count++;
+			break;
+		}
+		default:
+			/* error message has already been printed */
+			fprintf(stderr, "Try `%s --help' for more information.\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* Make sure that the combination of provided parameters makes sense */
+
+	if (read_mode + erase_mode + check_mode + test_mode + blank_mode > 1) {
+		fprintf(stderr, "%s: options `-r'/`-R', `-e`, `-c', `-S', `-t' and `--blank-check' are mutually exclusive\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (job_file && (read_mode || erase_mode || check_mode || test_mode || blank_mode || bulk_erase ||
+			 dont_erase || disable_protect || rw_offset || optind != argc)) {
+		fprintf(stderr, "%s: option `-j' can't be combined with other modes or file names\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (resume && !journal_file) {
+		fprintf(stderr, "%s: option `--resume' needs a journal file\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (journal_file && (read_mode || erase_mode || check_mode || test_mode || job_file ||
+			     bulk_erase || dont_erase)) {
+		fprintf(stderr, "%s: option `--journal' only valid in default programming mode\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (keep_data && (read_mode || erase_mode || check_mode || test_mode || job_file ||
+			  bulk_erase || dont_erase || journal_file)) {
+		fprintf(stderr, "%s: option `-k' only valid in default programming mode\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (bulk_erase && dont_erase) {
+		fprintf(stderr, "%s: options `-b' and `-n' are mutually exclusive\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (blank_mode && (bulk_erase || dont_erase || keep_data || journal_file || optind != argc)) {
+		fprintf(stderr, "%s: option `--blank-check' can't be combined with writing options or file names\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (prog_sram && (read_mode || erase_mode || check_mode || test_mode || blank_mode || job_file ||
+			  journal_file || keep_data || bulk_erase || dont_erase || disable_protect ||
+			  dry_run || ab_mode || rw_offset)) {
+		fprintf(stderr, "%s: option `-S' can't be combined with flash options\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (ab_mode && (read_mode || erase_mode || check_mode || test_mode || blank_mode || job_file ||
+			journal_file || keep_data || bulk_erase || dont_erase || dry_run || rw_offset)) {
+		fprintf(stderr, "%s: option `--ab' only valid when writing an image in default mode\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (ab_mode && (!ab_slot[0] || !ab_slot[1] || ab_slot[0] == ab_slot[1] ||
+			(ab_slot[0] | ab_slot[1]) & 0xffff || ab_slot[0] > 0xffffff || ab_slot[1] > 0xffffff)) {
+		fprintf(stderr, "%s: A/B slots must be different, 64kB aligned, above the boot header "
+			"and below 16 MB\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (patch_count && (read_mode || erase_mode || check_mode || test_mode || blank_mode || job_file ||
+			    prog_sram || dry_run)) {
+		fprintf(stderr, "%s: option `--patch' only valid when writing files to flash\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	// Each run takes new patch values, so a journal would never match the image
+	if (patch_count && journal_file) {
+		fprintf(stderr, "%s: option `--patch' can't be combined with `--journal'\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (repair && (read_mode || erase_mode || test_mode || blank_mode || prog_sram)) {
+		fprintf(stderr, "%s: option `--repair' only valid when verifying\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (inline_verify && (read_mode || erase_mode || check_mode || test_mode || blank_mode || prog_sram ||
+			      keep_data || journal_file)) {
+		fprintf(stderr, "%s: option `--inline-verify' can't be combined with -c, -k, --journal or other modes\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (watch_log && (read_mode || journal_file || dry_run || devstr)) {
+		fprintf(stderr, "%s: option `--watch' can't be combined with -r, -R, -d, --journal or --dry-run\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (dry_run && (test_mode || blank_mode || journal_file || keep_data)) {
+		fprintf(stderr, "%s: option `--dry-run' not supported with `-t', `-k', `--blank-check' or `--journal'\n", my_name);
+		return EXIT_FAILURE;
+	}
+
+	if (disable_protect && (read_mode || check_mode || test_mode)) {
 		fprintf(stderr, "%s: option `-p' only valid in programming mode\n", my_name);
 		return EXIT_FAILURE;
 	}
@@ -664,7 +2774,7 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	if (optind + 1 == argc) {
+	if (optind + 1 == argc || (optind < argc && !read_mode)) {
 		if (test_mode) {
 			fprintf(stderr, "%s: test mode doesn't take a file name\n", my_name);
 			fprintf(stderr, "Try `%s --help' for more information.\n", argv[0]);
@@ -677,7 +2787,7 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	} else if (bulk_erase || disable_protect) {
 		filename = "/dev/null";
-	} else if (!test_mode && !erase_mode && !disable_protect) {
+	} else if (!test_mode && !erase_mode && !disable_protect && !job_file && !blank_mode) {
 		fprintf(stderr, "%s: missing argument\n", my_name);
 		fprintf(stderr, "Try `%s --help' for more information.\n", argv[0]);
 		return EXIT_FAILURE;
@@ -687,12 +2797,20 @@ int main(int argc, char **argv)
 	   so we can fail before initializing the hardware */
 
 	FILE *f = NULL;
-	long file_size = -1;
+	struct image img = { NULL, 0 };
+	struct job *jobs = NULL;
+	int job_count = 0;
 
-	if (test_mode) {
+	if (job_file) {
+		job_count = load_jobs(job_file, &jobs);
+		if (job_count < 0)
+			return EXIT_FAILURE;
+	} else if (test_mode || blank_mode) {
 		/* nop */;
 	} else if (erase_mode) {
-		file_size = erase_size;
+		/* nop */;
+	} else if (read_mode && dry_run) {
+		/* nop */;
 	} else if (read_mode) {
 		f = (strcmp(filename, "-") == 0) ? stdout : fopen(filename, "wb");
 		if (f == NULL) {
@@ -701,78 +2819,169 @@ int main(int argc, char **argv)
 			return EXIT_FAILURE;
 		}
 	} else {
-		f = (strcmp(filename, "-") == 0) ? stdin : fopen(filename, "rb");
-		if (f == NULL) {
-			fprintf(stderr, "%s: can't open '%s' for reading: ", my_name, filename);
-			perror(0);
-			return EXIT_FAILURE;
+		/* Load all the input files into memory, this way they can
+		   come from pipes and we know the size of each region in
+		   advance in order to erase the correct amount of memory.
+		   Each argument can be given as `file@offset'. */
+
+		for (int i = optind; i < argc || i == optind; i++) {
+			const char *arg = i < argc ? argv[i] : filename;
+			char name[4096];
+			uint32_t offset = rw_offset;
+			const char *at = strrchr(arg, '@');
+
+			if (at && at != arg && !parse_size(at + 1, &offset)) {
+				snprintf(name, sizeof(name), "%.*s", (int)(at - arg), arg);
+				arg = name;
+			}
+			if (load_input(&img, arg, offset)) {
+				fprintf(stderr, "%s: can't load '%s'\n", my_name, arg);
+				return EXIT_FAILURE;
+			}
 		}
+		if (image_finish(&img))
+			return EXIT_FAILURE;
+	}
 
-		/* For regular programming, we need to read the file
-		   twice--once for programming and once for verifying--and
-		   need to know the file size in advance in order to erase
-		   the correct amount of memory.
-
-		   See if we can seek on the input file.  Checking for "-"
-		   as an argument isn't enough as we might be reading from a
-		   named pipe, or contrarily, the standard input may be an
-		   ordinary file. */
+	for (int i = 0; i < patch_count; i++) {
+		if (image_read(&img, patches[i].offset, NULL, patches[i].length) != patches[i].length) {
+			fprintf(stderr, "%s: patch field 0x%06X +%u is not inside the input data\n",
+				my_name, patches[i].offset, patches[i].length);
+			return EXIT_FAILURE;
+		}
+	}
 
-		if (!check_mode) {
-			if (fseek(f, 0L, SEEK_END) != -1) {
-				file_size = ftell(f);
-				if (file_size == -1) {
-					fprintf(stderr, "%s: %s: ftell: ", my_name, filename);
-					perror(0);
-					return EXIT_FAILURE;
-				}
-				if (fseek(f, 0L, SEEK_SET) == -1) {
-					fprintf(stderr, "%s: %s: fseek: ", my_name, filename);
-					perror(0);
-					return EXIT_FAILURE;
-				}
-			} else {
-				FILE *pipe = f;
+	if (ab_mode && img.count) {
+		const struct image_region *last = &img.regions[img.count - 1];
+		uint32_t room = ab_slot[0] > ab_slot[1] ? ab_slot[0] - ab_slot[1] : ab_slot[1] - ab_slot[0];
+		if (last->addr + last->size > room) {
+			fprintf(stderr, "%s: the image (%u bytes) doesn't fit in an A/B slot (%u bytes)\n",
+				my_name, last->addr + last->size, room);
+			return EXIT_FAILURE;
+		}
+	}
 
-				f = tmpfile();
-				if (f == NULL) {
-					fprintf(stderr, "%s: can't open temporary file\n", my_name);
-					return EXIT_FAILURE;
-				}
-				file_size = 0;
+	// ---------------------------------------------------------
+	// Plan the operations
+	// ---------------------------------------------------------
 
-				while (true) {
-					static unsigned char buffer[4096];
-					size_t rc = fread(buffer, 1, 4096, pipe);
-					if (rc <= 0)
-						break;
-					size_t wc = fwrite(buffer, 1, rc, f);
-					if (wc != rc) {
-						fprintf(stderr, "%s: can't write to temporary file\n", my_name);
-						return EXIT_FAILURE;
-					}
-					file_size += rc;
-				}
-				fclose(pipe);
+	struct plan plan = { NULL, 0, &img, f };
+	struct image_region erase_region = { rw_offset, erase_size, NULL };
+	struct image erase_img = { &erase_region, 1 };
+	struct plan_cost cost;
+
+	if (read_mode) {
+		plan_add(&plan, STEP_READ, rw_offset, read_size);
+	} else if (check_mode) {
+		plan_image(&plan, STEP_VERIFY, &img);
+	} else if (!test_mode && !blank_mode && !job_file && !journal_file && !keep_data && !ab_mode &&
+		   !prog_sram) {
+		if (disable_protect)
+			plan_add(&plan, STEP_UNPROTECT, 0, 0);
+		if (bulk_erase)
+			plan_add(&plan, STEP_BULK_ERASE, 0, 0);
+		else if (!dont_erase)
+			plan_erase(&plan, erase_mode ? &erase_img : &img);
+		if (!erase_mode) {
+			plan_write(&plan, &img);
+		}
+	}
 
-				/* now seek to the beginning so we can
-				   start reading again */
-				fseek(f, 0, SEEK_SET);
-			}
+	/* Until the programmer is found, assume a typical USB round trip */
+	cost.link_rate = (baud ? baud : 115200) / 10.0;
+	cost.rtt = 0.001;
+	cost.spi_rate = (slow_clock ? 50000 : 6000000) / 8.0;
+	if (devstr && !strncmp(devstr, "tcp:", 4))
+		cost.link_rate = 1e6;
+
+	if (dry_run) {
+		if (job_file)
+			print_jobs(jobs, job_count, &cost);
+		else {
+			fprintf(stderr, "plan:\n");
+			plan_print(&plan, &cost);
 		}
+		return EXIT_SUCCESS;
+	}
+
+	if (watch_log) {
+#ifdef _WIN32
+		fprintf(stderr, "%s: option `--watch' is not supported on Windows\n", my_name);
+		return EXIT_FAILURE;
+#else
+		/* Only returns in the process programming a new board */
+		devstr = watch_programmers(watch_log, baud ? baud : 115200);
+#endif
 	}
 
+	log_init(log_lvl, LOG_RING_SIZE);
+
 	// ---------------------------------------------------------
 	// Initialize USB connection to FT2232H
 	// ---------------------------------------------------------
 
-        if (devstr == NULL)
-            devstr = serialport_get_default_device();
+	char found_dev[SERIAL_NAME_MAX];
+	if (devstr == NULL) {
+		if (!serprog_discover(baud ? baud : 115200, found_dev, sizeof(found_dev)))
+			devstr = found_dev;
+		else
+			devstr = serialport_get_default_device();
+	}
+
+	if (!baud) {
+		baud = serial_auto_baud(devstr);
+		if (!baud) {
+			fprintf(stderr, "Can't find SERPROG device at any baud rate (device string %s).\n", devstr);
+			exit(2);
+		}
+		if (baud > 0)
+			fprintf(stderr, "using %d baud\n", baud);
+		else
+			baud = 0;
+	} else if (serialport_open(devstr, baud)) {
+		fprintf(stderr, "Can't find SERPROG device (device string %s).\n", devstr);
+		exit(2);
+	}
+
+	/* Programmers with a USB serial number have their capabilities cached */
+	char usb_serial[128];
+	struct serprog_caps caps;
+	bool has_serial = !serialport_get_serial(devstr, usb_serial, sizeof(usb_serial));
+	bool cached = has_serial && !rescan && !cache_load(usb_serial, &caps);
 
-	if (serialport_open(devstr, 115200) || serprog_detect() ) {
+	if (serprog_detect(cached ? &caps : NULL)) {
 		fprintf(stderr, "Can't find SERPROG device (device string %s).\n", devstr);
 		exit(2);
 	}
+	if (has_serial && !cached) {
+		serprog_get_caps(&caps);
+		if (cache_save(usb_serial, &caps))
+			fprintf(stderr, "can't write the programmer capabilities cache\n");
+	}
+
+	/* Fill in the fields of this board */
+	for (int i = 0; i < patch_count; i++) {
+		uint8_t value[PATCH_MAX];
+		if (patch_value(&patches[i], devstr, has_serial ? usb_serial : "", value))
+			exit(EXIT_FAILURE);
+		image_write(&img, patches[i].offset, value, patches[i].length);
+		fprintf(stderr, "patch 0x%06X:", patches[i].offset);
+		for (uint32_t j = 0; j < patches[i].length; j++)
+			fprintf(stderr, " %02x", value[j]);
+		fprintf(stderr, "\n");
+	}
+
+	/* Network connections have no baud rate */
+	if (!strncmp(devstr, "tcp:", 4))
+		baud = 0;
+
+	if (low_latency) {
+		double rtt = serprog_measure_rtt(20);
+		if (serialport_low_latency())
+			fprintf(stderr, "some serial port latency settings are not supported\n");
+		fprintf(stderr, "round trip time: %.3f ms before tuning, %.3f ms after\n",
+			rtt * 1000, serprog_measure_rtt(20) * 1000);
+	}
 
         unsigned clock = 0;
 	if (slow_clock) {
@@ -784,16 +2993,43 @@ int main(int argc, char **argv)
 	}
         fprintf(stderr, "actual SPI clock: %.3f kHz\n", 0.001 * clock);
 
+	/* Size the transfers and estimate times with the real link */
+	struct serprog_link link;
+	if (serprog_profile_link()) {
+		fprintf(stderr, "Can't measure the link to the SERPROG device.\n");
+		exit(2);
+	}
+	serprog_get_link(&link);
+	cost.rtt = link.rtt;
+	cost.link_rate = link.bandwidth;
+	if (clock)
+		cost.spi_rate = clock / 8.0;
+
 	fprintf(stderr, "cdone: %s\n", get_cdone() ? "high" : "low");
 
+	// Keep the FPGA off the SPI bus before the programmer drives it
+	fpga_reset();
         enable_prog();
 	usleep(100000);
 
-	if (test_mode)
+	if (cdone_required && !serprog_has_gpio()) {
+		fprintf(stderr, "The programmer can't read CDONE, `--wait-cdone' not possible.\n");
+		exit(2);
+	}
+
+	if (prog_sram)
+	{
+		if (!serprog_has_gpio()) {
+			fprintf(stderr, "The programmer can't control CRESET, SRAM programming not possible.\n");
+			exit(2);
+		}
+		fpga_prog_sram(&img, cdone_timeout);
+	}
+	else if (test_mode)
 	{
 		fprintf(stderr, "reset..\n");
 
-		usleep(250000);
+		fpga_reset();
 
 		fprintf(stderr, "cdone: %s\n", get_cdone() ? "high" : "low");
 
@@ -803,9 +3039,8 @@ int main(int argc, char **argv)
 
 		flash_power_down();
 
-		usleep(250000);
-
-		fprintf(stderr, "cdone: %s\n", get_cdone() ? "high" : "low");
+		fpga_release();
+		fpga_report_cdone(cdone_timeout, cdone_required);
 	}
 	else /* program flash */
 	{
@@ -815,7 +3050,7 @@ int main(int argc, char **argv)
 
 		fprintf(stderr, "reset..\n");
 
-		usleep(250000);
+		fpga_reset();
 
 		fprintf(stderr, "cdone: %s\n", get_cdone() ? "high" : "low");
 
@@ -829,87 +3064,60 @@ int main(int argc, char **argv)
 		// Program
 		// ---------------------------------------------------------
 
-		if (!read_mode && !check_mode)
+		if (job_file)
+		{
+			run_jobs(jobs, job_count, &cost);
+		}
+		else if (blank_mode)
+		{
+			fprintf(stderr, "blank check..\n");
+			if (flash_blank_check(rw_offset, blank_size)) {
+				fprintf(stderr, "Flash is not blank!\n");
+				exit(3);
+			}
+			fprintf(stderr, "BLANK OK\n");
+		}
+		else if (ab_mode)
 		{
 			if (disable_protect)
 			{
 				flash_write_enable();
 				flash_disable_protection();
 			}
+			flash_write_ab(&img, ab_slot);
+		}
+		else if (journal_file || keep_data)
+		{
+			struct plan verify = { NULL, 0, &img, NULL };
 
-			if (!dont_erase)
-			{
-				if (bulk_erase)
-				{
-					flash_write_enable();
-					flash_bulk_erase();
-					flash_wait();
-				}
-				else
-				{
-					fprintf(stderr, "file size: %ld\n", file_size);
-
-					int begin_addr = rw_offset & ~0xffff;
-					int end_addr = (rw_offset + file_size + 0xffff) & ~0xffff;
-
-					for (int addr = begin_addr; addr < end_addr; addr += 0x10000) {
-						flash_write_enable();
-						flash_64kB_sector_erase(addr);
-						if (verbose) {
-							fprintf(stderr, "Status after block erase:\n");
-							flash_read_status();
-						}
-						flash_wait();
-					}
-				}
-			}
-
-			if (!erase_mode)
+			if (disable_protect)
 			{
-				fprintf(stderr, "programming..\n");
-
-				for (int rc, addr = 0; true; addr += rc) {
-					uint8_t buffer[256];
-					int page_size = 256 - (rw_offset + addr) % 256;
-					rc = fread(buffer, 1, page_size, f);
-					if (rc <= 0)
-						break;
-					flash_write_enable();
-					flash_prog(rw_offset + addr, buffer, rc);
-					flash_wait();
-				}
-
-				/* seek to the beginning for second pass */
-				fseek(f, 0, SEEK_SET);
+				flash_write_enable();
+				flash_disable_protection();
 			}
+			fprintf(stderr, "programming..\n");
+			if (journal_file)
+				flash_write_journal(&img, journal_file, resume);
+			else
+				flash_write_keep(&img);
+
+			plan_image(&verify, STEP_VERIFY, &img);
+			plan_execute(&verify);
+			free(verify.steps);
+
+			/* The write is complete, the journal is not needed */
+			if (journal_file)
+				remove(journal_file);
 		}
+		else
+		{
+			double start = get_time();
 
-		// ---------------------------------------------------------
-		// Read/Verify
-		// ---------------------------------------------------------
-
-		if (read_mode) {
-			fprintf(stderr, "reading..\n");
-			for (int addr = 0; addr < read_size; addr += 256) {
-				uint8_t buffer[256];
-				flash_read(rw_offset + addr, buffer, 256);
-				fwrite(buffer, read_size - addr > 256 ? 256 : read_size - addr, 1, f);
-			}
-		} else if (!erase_mode) {
-			fprintf(stderr, "reading..\n");
-			for (int addr = 0; true; addr += 256) {
-				uint8_t buffer_flash[256], buffer_file[256];
-				int rc = fread(buffer_file, 1, 256, f);
-				if (rc <= 0)
-					break;
-				flash_read(rw_offset + addr, buffer_flash, rc);
-				if (memcmp(buffer_file, buffer_flash, rc)) {
-					fprintf(stderr, "Found difference between flash and file!\n");
-					exit(3);
-				}
-			}
-
-			fprintf(stderr, "VERIFY OK\n");
+			fprintf(stderr, "estimated time: %.3f s\n", plan_time(&plan, &cost));
+			if (log_enabled(LOG_DEBUG))
+				plan_print(&plan, &cost);
+			plan_execute(&plan);
+			fprintf(stderr, "done in %.3f s\n", get_time() - start);
 		}
 
 
@@ -919,18 +3127,22 @@ int main(int argc, char **argv)
 
 		flash_power_down();
 
-		usleep(250000);
-
-		fprintf(stderr, "cdone: %s\n", get_cdone() ? "high" : "low");
+		fpga_release();
+		fpga_report_cdone(cdone_timeout, cdone_required);
 	}
 
-	if (f != NULL && f != stdin && f != stdout)
+	if (f != NULL && f != stdout)
 		fclose(f);
+	image_free(&img);
+	free(jobs);
+	free(plan.steps);
 
 	// ---------------------------------------------------------
 	// Exit
 	// ---------------------------------------------------------
 
+	log_flush();
+	print_stats(baud);
 	fprintf(stderr, "Bye.\n");
         disable_prog();
         serialport_close();
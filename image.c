@@ -0,0 +1,262 @@
+/*
+ *  iceprog -- simple programming tool for Lattice iCE FPGA
+ *
+ *  Copyright (C) 2015  Clifford Wolf <clifford@clifford.at>
+ *  Copyright (C) 2018  Piotr Esden-Tempski <piotr@esden.net>
+ *  Copyright (C) 2018  Daniel Serpell <daniel.serpell@gmail.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * image.c: Flash images made of one or more data regions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include "image.h"
+
+int image_add(struct image *img, uint32_t addr, const uint8_t *data, uint32_t size)
+{
+    struct image_region *r;
+
+    if (!size)
+        return 0;
+
+    // Extend the last region if the new data follows it
+    if (img->count) {
+        r = &img->regions[img->count - 1];
+        if (r->addr + r->size == addr) {
+            uint8_t *buf = realloc(r->data, r->size + size);
+            if (!buf)
+                goto nomem;
+            memcpy(buf + r->size, data, size);
+            r->data = buf;
+            r->size += size;
+            return 0;
+        }
+    }
+
+    r = realloc(img->regions, (img->count + 1) * sizeof(*r));
+    if (!r)
+        goto nomem;
+    img->regions = r;
+    r += img->count;
+    r->data = malloc(size);
+    if (!r->data)
+        goto nomem;
+    memcpy(r->data, data, size);
+    r->addr = addr;
+    r->size = size;
+    img->count++;
+    return 0;
+
+nomem:
+    fprintf(stderr, "Error: out of memory loading image\n");
+    return 1;
+}
+
+static int hex_value(const char *s, int n)
+{
+    int v = 0;
+    for (int i = 0; i < n; i++) {
+        int c = s[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9')
+            v |= c - '0';
+        else if (c >= 'A' && c <= 'F')
+            v |= c - 'A' + 10;
+        else if (c >= 'a' && c <= 'f')
+            v |= c - 'a' + 10;
+        else
+            return -1;
+    }
+    return v;
+}
+
+static int image_load_ihex(struct image *img, FILE *f, const char *filename, uint32_t offset)
+{
+    char line[600];
+    uint32_t base = 0;
+    int lnum = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        uint8_t rec[256 + 5];
+        int len = strcspn(line, "\r\n");
+        int sum = 0;
+
+        lnum++;
+        if (!len)
+            continue;
+        if (line[0] != ':' || len < 11 || !(len & 1) || (len - 1) / 2 > (int)sizeof(rec))
+            goto bad;
+        for (int i = 0; i < (len - 1) / 2; i++) {
+            int v = hex_value(line + 1 + 2 * i, 2);
+            if (v < 0)
+                goto bad;
+            rec[i] = v;
+            sum += v;
+        }
+        if (rec[0] + 5 != (len - 1) / 2 || (sum & 0xFF))
+            goto bad;
+
+        uint32_t addr = (rec[1] << 8) | rec[2];
+        switch (rec[3]) {
+        case 0x00: // Data
+            if (image_add(img, offset + base + addr, rec + 4, rec[0]))
+                return 1;
+            break;
+        case 0x01: // End of file
+            return 0;
+        case 0x02: // Extended segment address
+            base = ((rec[4] << 8) | rec[5]) << 4;
+            break;
+        case 0x04: // Extended linear address
+            base = ((rec[4] << 8) | rec[5]) << 16;
+            break;
+        case 0x03: // Start addresses, ignored
+        case 0x05:
+            break;
+        default:
+            goto bad;
+        }
+    }
+    fprintf(stderr, "%s: missing end of file record\n", filename);
+    return 1;
+
+bad:
+    fprintf(stderr, "%s:%d: invalid Intel HEX record\n", filename, lnum);
+    return 1;
+}
+
+static int image_load_binary(struct image *img, FILE *f, const char *filename, uint32_t offset)
+{
+    static uint8_t buffer[65536];
+    size_t rc;
+
+    while ((rc = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        if (image_add(img, offset, buffer, rc))
+            return 1;
+        offset += rc;
+    }
+    if (ferror(f)) {
+        fprintf(stderr, "%s: read error: %s\n", filename, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+int image_load(struct image *img, const char *filename, uint32_t offset)
+{
+    const char *ext = strrchr(filename, '.');
+    int is_hex = ext && (!strcasecmp(ext, ".hex") || !strcasecmp(ext, ".ihex") ||
+                         !strcasecmp(ext, ".mcs"));
+    FILE *f;
+    int ret;
+
+    f = (strcmp(filename, "-") == 0) ? stdin : fopen(filename, is_hex ? "r" : "rb");
+    if (f == NULL) {
+        fprintf(stderr, "can't open '%s' for reading: %s\n", filename, strerror(errno));
+        return 1;
+    }
+    if (is_hex)
+        ret = image_load_ihex(img, f, filename, offset);
+    else
+        ret = image_load_binary(img, f, filename, offset);
+    if (f != stdin)
+        fclose(f);
+    return ret;
+}
+
+static int region_cmp(const void *a, const void *b)
+{
+    const struct image_region *ra = a, *rb = b;
+    return ra->addr < rb->addr ? -1 : ra->addr > rb->addr;
+}
+
+int image_finish(struct image *img)
+{
+    int n = 0;
+
+    if (!img->count)
+        return 0;
+
+    qsort(img->regions, img->count, sizeof(*img->regions), region_cmp);
+    for (int i = 1; i < img->count; i++) {
+        struct image_region *p = &img->regions[n], *r = &img->regions[i];
+        if (r->addr < p->addr + p->size) {
+            fprintf(stderr, "Error: image data overlaps at address 0x%06X\n", r->addr);
+            return 1;
+        }
+        if (r->addr == p->addr + p->size) {
+            uint8_t *buf = realloc(p->data, p->size + r->size);
+            if (!buf) {
+                fprintf(stderr, "Error: out of memory loading image\n");
+                return 1;
+            }
+            memcpy(buf + p->size, r->data, r->size);
+            free(r->data);
+            p->data = buf;
+            p->size += r->size;
+        } else
+            img->regions[++n] = *r;
+    }
+    img->count = n + 1;
+    return 0;
+}
+
+uint32_t image_read(const struct image *img, uint32_t addr, uint8_t *buf, uint32_t size)
+{
+    uint32_t count = 0;
+
+    for (int i = 0; i < img->count; i++) {
+        const struct image_region *r = &img->regions[i];
+        uint32_t begin = r->addr > addr ? r->addr : addr;
+        uint32_t end = r->addr + r->size < addr + size ? r->addr + r->size : addr + size;
+        if (begin >= end)
+            continue;
+        if (buf)
+            memcpy(buf + (begin - addr), r->data + (begin - r->addr), end - begin);
+        count += end - begin;
+    }
+    return count;
+}
+
+uint32_t image_write(struct image *img, uint32_t addr, const uint8_t *buf, uint32_t size)
+{
+    uint32_t count = 0;
+
+    for (int i = 0; i < img->count; i++) {
+        struct image_region *r = &img->regions[i];
+        uint32_t begin = r->addr > addr ? r->addr : addr;
+        uint32_t end = r->addr + r->size < addr + size ? r->addr + r->size : addr + size;
+        if (begin >= end)
+            continue;
+        memcpy(r->data + (begin - r->addr), buf + (begin - addr), end - begin);
+        count += end - begin;
+    }
+    return count;
+}
+
+void image_free(struct image *img)
+{
+    for (int i = 0; i < img->count; i++)
+        free(img->regions[i].data);
+    free(img->regions);
+    img->regions = NULL;
+    img->count = 0;
+}
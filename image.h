@@ -0,0 +1,66 @@
+/*
+ *  iceprog -- simple programming tool for Lattice iCE FPGA
+ *
+ *  Copyright (C) 2015  Clifford Wolf <clifford@clifford.at>
+ *  Copyright (C) 2018  Piotr Esden-Tempski <piotr@esden.net>
+ *  Copyright (C) 2018  Daniel Serpell <daniel.serpell@gmail.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * image.h: Flash images made of one or more data regions.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Contiguous data to be written at "addr" */
+struct image_region {
+    uint32_t addr;
+    uint32_t size;
+    uint8_t *data;
+};
+
+/* Sparse flash image, regions sorted by address and not overlapping after
+ * image_finish() */
+struct image {
+    struct image_region *regions;
+    int count;
+};
+
+/* Loads a file into the image. Files with ".hex", ".ihex" or ".mcs"
+ * extension are parsed as Intel HEX, other files are raw binary data. The
+ * data is placed at "offset" (added to the Intel HEX addresses). "-" reads
+ * from standard input. Returns 0 on success. */
+int image_load(struct image *img, const char *filename, uint32_t offset);
+
+/* Adds a copy of "size" bytes from "data" at address "addr". */
+int image_add(struct image *img, uint32_t addr, const uint8_t *data, uint32_t size);
+
+/* Sorts and merges the regions, returns 1 if two regions overlap. */
+int image_finish(struct image *img);
+
+/* Copies the image data inside [addr, addr + size) to the same position in
+ * "buf", leaving the bytes not covered by the image untouched. Returns the
+ * number of bytes covered. If "buf" is NULL, only counts the bytes. */
+uint32_t image_read(const struct image *img, uint32_t addr, uint8_t *buf, uint32_t size);
+
+/* Overwrites the image data inside [addr, addr + size) with the bytes at
+ * the same position in "buf". Returns the number of bytes covered. */
+uint32_t image_write(struct image *img, uint32_t addr, const uint8_t *buf, uint32_t size);
+
+/* Frees all memory used by the image. */
+void image_free(struct image *img);
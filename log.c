@@ -0,0 +1,249 @@
+/*
+ *  iceprog -- simple programming tool for Lattice iCE FPGA
+ *
+ *  Copyright (C) 2015  Clifford Wolf <clifford@clifford.at>
+ *  Copyright (C) 2018  Piotr Esden-Tempski <piotr@esden.net>
+ *  Copyright (C) 2018  Daniel Serpell <daniel.serpell@gmail.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * log.c: Buffered diagnostic log.
+ *
+ * Messages are formatted into a preallocated ring buffer, and a writer
+ * thread copies them to stderr in large writes, every 100 ms or as soon as
+ * the buffer is half full. The programming thread never waits for stderr
+ * unless the buffer fills up, so the verbose output barely changes the
+ * timing it is meant to show.
+ *
+ * While the log runs, stderr itself is routed through the ring as well
+ * (where the C library allows it), so the other messages keep their place
+ * among the log lines instead of overtaking them.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "log.h"
+
+/* Longest single message, longer ones are truncated */
+#define LOG_LINE_MAX 512
+/* Data bytes on each hex line */
+#define LOG_HEX_BYTES 32
+
+enum log_level log_level = LOG_INFO;
+
+static char *ring;
+static size_t ring_size;
+// Total bytes ever queued and written, the ring positions are modulo size
+static size_t ring_head, ring_tail;
+static bool running, stopping;
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t room = PTHREAD_COND_INITIALIZER;
+static double start_time;
+// The real stderr, while it is routed through the ring
+static FILE *stderr_real;
+
+static void log_route_stderr(void);
+
+static double log_time(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+static void *log_writer(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        if (ring_head == ring_tail) {
+            struct timespec ts;
+            if (stopping)
+                break;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 100000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&wake, &lock, &ts);
+            continue;
+        }
+
+        // Write the pending bytes up to the end of the ring, unlocked
+        size_t pos = ring_tail % ring_size;
+        size_t n = ring_head - ring_tail;
+        if (n > ring_size - pos)
+            n = ring_size - pos;
+        pthread_mutex_unlock(&lock);
+        for (size_t done = 0; done < n; ) {
+            ssize_t r = write(2, ring + pos + done, n - done);
+            if (r <= 0)
+                break;
+            done += r;
+        }
+        pthread_mutex_lock(&lock);
+        ring_tail += n;
+        pthread_cond_broadcast(&room);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+void log_init(enum log_level level, size_t size)
+{
+    start_time = log_time();
+    if (level == LOG_INFO)
+        return;
+
+    ring = malloc(size);
+    if (!ring) {
+        fprintf(stderr, "out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    ring_size = size;
+    ring_head = ring_tail = 0;
+    stopping = false;
+    if (pthread_create(&writer, NULL, log_writer, NULL)) {
+        free(ring);
+        ring = NULL;
+        fprintf(stderr, "can't start the log writer, verbose output disabled\n");
+        return;
+    }
+    running = true;
+    log_level = level;
+    log_route_stderr();
+    atexit(log_flush);
+}
+
+// Queues "n" bytes, waiting for the writer only if the ring is full
+static void log_put(const char *s, size_t n)
+{
+    pthread_mutex_lock(&lock);
+    if (!running) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    while (ring_head - ring_tail + n > ring_size) {
+        pthread_cond_signal(&wake);
+        pthread_cond_wait(&room, &lock);
+    }
+    size_t pos = ring_head % ring_size;
+    size_t first = n > ring_size - pos ? ring_size - pos : n;
+    memcpy(ring + pos, s, first);
+    memcpy(ring, s + first, n - first);
+    ring_head += n;
+    if (ring_head - ring_tail >= ring_size / 2)
+        pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+}
+
+#ifdef __GLIBC__
+static ssize_t log_stream_write(void *cookie, const char *buf, size_t size)
+{
+    (void)cookie;
+    log_put(buf, size);
+    return size;
+}
+
+// Replaces stderr with an unbuffered stream writing into the ring
+static void log_route_stderr(void)
+{
+    cookie_io_functions_t io = { NULL, log_stream_write, NULL, NULL };
+    FILE *f = fopencookie(NULL, "w", io);
+
+    if (!f)
+        return;
+    setvbuf(f, NULL, _IONBF, 0);
+    fflush(stderr);
+    stderr_real = stderr;
+    stderr = f;
+}
+#else
+static void log_route_stderr(void)
+{
+}
+#endif
+
+void log_printf(enum log_level level, const char *fmt, ...)
+{
+    char line[LOG_LINE_MAX];
+    va_list ap;
+    int n;
+
+    if (!log_enabled(level))
+        return;
+
+    n = snprintf(line, sizeof(line), "%10.6f ", log_time() - start_time);
+    va_start(ap, fmt);
+    vsnprintf(line + n, sizeof(line) - n, fmt, ap);
+    va_end(ap);
+    log_put(line, strlen(line));
+}
+
+void log_hex(enum log_level level, uint32_t addr, const uint8_t *data, size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+    char line[32 + 3 * LOG_HEX_BYTES];
+
+    if (!log_enabled(level))
+        return;
+
+    for (size_t pos = 0; pos < size; pos += LOG_HEX_BYTES) {
+        size_t n = size - pos > LOG_HEX_BYTES ? LOG_HEX_BYTES : size - pos;
+        int len = snprintf(line, sizeof(line), "%10s 0x%06X:", "", (unsigned)(addr + pos));
+        for (size_t i = 0; i < n; i++) {
+            line[len++] = ' ';
+            line[len++] = digits[data[pos + i] >> 4];
+            line[len++] = digits[data[pos + i] & 15];
+        }
+        line[len++] = '\n';
+        log_put(line, len);
+    }
+}
+
+void log_flush(void)
+{
+    pthread_mutex_lock(&lock);
+    if (!running) {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    stopping = true;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+
+    if (stderr_real) {
+        FILE *f = stderr;
+        stderr = stderr_real;
+        stderr_real = NULL;
+        fclose(f);
+    }
+
+    pthread_join(writer, NULL);
+    running = false;
+    log_level = LOG_INFO;
+}
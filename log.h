@@ -0,0 +1,53 @@
+/*
+ *  iceprog -- simple programming tool for Lattice iCE FPGA
+ *
+ *  Copyright (C) 2015  Clifford Wolf <clifford@clifford.at>
+ *  Copyright (C) 2018  Piotr Esden-Tempski <piotr@esden.net>
+ *  Copyright (C) 2018  Daniel Serpell <daniel.serpell@gmail.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * log.h: Buffered diagnostic log.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum log_level {
+    LOG_INFO,   /* default, diagnostics off */
+    LOG_DEBUG,  /* -v: flash operations */
+    LOG_TRACE,  /* -vv: also data bytes and status registers */
+};
+
+extern enum log_level log_level;
+
+#define log_enabled(level) ((level) <= log_level)
+
+/* Starts logging the messages up to "level", through a ring buffer of
+ * "size" bytes. The log is flushed at exit. */
+void log_init(enum log_level level, size_t size);
+
+/* Logs one message, prefixed with the time since log_init(). */
+void log_printf(enum log_level level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* Logs "size" bytes in hex, 32 on each line, labelled from "addr". */
+void log_hex(enum log_level level, uint32_t addr, const uint8_t *data, size_t size);
+
+/* Writes out all the buffered messages and stops the writer thread. */
+void log_flush(void);
@@ -0,0 +1,254 @@
+/*
+ *  iceprog -- simple programming tool for Lattice iCE FPGA
+ *
+ *  Copyright (C) 2015  Clifford Wolf <clifford@clifford.at>
+ *  Copyright (C) 2018  Piotr Esden-Tempski <piotr@esden.net>
+ *  Copyright (C) 2018  Daniel Serpell <daniel.serpell@gmail.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * patch.c: Per-board fields patched into the image.
+ *
+ * Counters and CSV row positions are kept in text files, locked while
+ * they are updated, so boards programmed at once in --watch mode never
+ * get the same value.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "patch.h"
+
+#ifndef _WIN32
+# include <sys/file.h>
+# include <unistd.h>
+#else
+# include <io.h>
+# define flock(fd, op) 0
+# define ftruncate _chsize
+# define popen _popen
+# define pclose _pclose
+#endif
+
+/* Longest CSV line or command output line */
+#define PATCH_LINE_MAX 1024
+
+int patch_parse_source(char *spec, struct patch *p)
+{
+    if (!strncmp(spec, "counter:", 8) && spec[8]) {
+        p->source = PATCH_COUNTER;
+        p->arg = spec + 8;
+    } else if (!strncmp(spec, "cmd:", 4) && spec[4]) {
+        p->source = PATCH_CMD;
+        p->arg = spec + 4;
+    } else if (!strncmp(spec, "csv:", 4) && spec[4]) {
+        char *colon = strrchr(spec + 4, ':'), *end;
+        p->source = PATCH_CSV;
+        p->arg = spec + 4;
+        p->column = 1;
+        if (colon) {
+            long column = strtol(colon + 1, &end, 10);
+            if (*end == 0 && column > 0) {
+                *colon = 0;
+                p->column = column;
+            }
+        }
+    } else
+        return 1;
+    return 0;
+}
+
+// Parses exactly "len" hex bytes, allowing ':', '-' or spaces between them
+static int parse_hex(const char *s, uint8_t *buf, uint32_t len)
+{
+    uint32_t n = 0;
+
+    while (*s) {
+        if (*s == ':' || *s == '-' || isspace((unsigned char)*s)) {
+            s++;
+            continue;
+        }
+        if (!isxdigit((unsigned char)s[0]) || !isxdigit((unsigned char)s[1]) || n == len)
+            return 1;
+        char byte[3] = { s[0], s[1], 0 };
+        buf[n++] = strtoul(byte, NULL, 16);
+        s += 2;
+    }
+    return n != len;
+}
+
+// Reads the number in the locked file "f" and stores "value + 1" in it,
+// in hex with the same number of digits if it was in hex
+static int take_number(FILE *f, const char *name, unsigned long long *value)
+{
+    char text[32], *end;
+    int ret;
+
+    if (fscanf(f, "%31s", text) != 1 || (*value = strtoull(text, &end, 0), *end)) {
+        fprintf(stderr, "%s: no number found\n", name);
+        return 1;
+    }
+    rewind(f);
+    if (!strncmp(text, "0x", 2) || !strncmp(text, "0X", 2))
+        ret = fprintf(f, "0x%0*llx\n", (int)strlen(text) - 2, *value + 1);
+    else
+        ret = fprintf(f, "%llu\n", *value + 1);
+    if (ret < 0 || fflush(f) || ftruncate(fileno(f), ret)) {
+        fprintf(stderr, "%s: can't update: %s\n", name, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// Takes the next value of a number file, creating it at 0 for CSV rows
+static int next_number(const char *name, int create, unsigned long long *value)
+{
+    int fd = open(name, create ? O_RDWR | O_CREAT : O_RDWR, 0666);
+    FILE *f = fd < 0 ? NULL : fdopen(fd, "r+");
+    int ret;
+
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    flock(fd, LOCK_EX);
+    // Another process may have created the file and not written it yet,
+    // so a new file is only started at 0 under the lock
+    if (create && fseek(f, 0, SEEK_END) == 0 && ftell(f) == 0)
+        fprintf(f, "0\n");
+    rewind(f);
+    ret = take_number(f, name, value);
+    flock(fileno(f), LOCK_UN);
+    fclose(f);
+    return ret;
+}
+
+static int counter_value(const struct patch *p, uint8_t *buf)
+{
+    unsigned long long value;
+
+    if (next_number(p->arg, 0, &value))
+        return 1;
+    if (p->length < 8 && value >> (8 * p->length)) {
+        fprintf(stderr, "%s: counter %llu doesn't fit in %u bytes\n", p->arg, value, p->length);
+        return 1;
+    }
+    // Big endian, as serial numbers and MAC addresses are read
+    for (uint32_t i = 0; i < p->length; i++)
+        buf[p->length - 1 - i] = i < 8 ? value >> (8 * i) : 0;
+    return 0;
+}
+
+/* Row taken from the last CSV file used */
+static const char *csv_file;
+static unsigned long long csv_row;
+
+static int csv_value(const struct patch *p, uint8_t *buf)
+{
+    char pos_name[PATCH_LINE_MAX], line[PATCH_LINE_MAX];
+    unsigned long long row, n = 0;
+    FILE *f;
+
+    // The next row to use is kept beside the CSV file. Each process programs
+    // one board, all the fields from the same file use the same row.
+    if (csv_file && !strcmp(csv_file, p->arg))
+        row = csv_row;
+    else {
+        snprintf(pos_name, sizeof(pos_name), "%s.next", p->arg);
+        if (next_number(pos_name, 1, &row))
+            return 1;
+        csv_file = p->arg;
+        csv_row = row;
+    }
+    f = fopen(p->arg, "r");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", p->arg, strerror(errno));
+        return 1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *field = line;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == 0)
+            continue;
+        if (n++ != row)
+            continue;
+        fclose(f);
+        for (int i = 1; i < p->column && field; i++)
+            if ((field = strchr(field, ',')) != NULL)
+                field++;
+        if (!field) {
+            fprintf(stderr, "%s: row %llu has no column %d\n", p->arg, row + 1, p->column);
+            return 1;
+        }
+        field[strcspn(field, ",\r\n")] = 0;
+        if (parse_hex(field, buf, p->length)) {
+            fprintf(stderr, "%s: row %llu: `%s' is not %u hex bytes\n", p->arg, row + 1, field, p->length);
+            return 1;
+        }
+        return 0;
+    }
+    fclose(f);
+    fprintf(stderr, "%s: all the %llu rows are used\n", p->arg, n);
+    return 1;
+}
+
+static int cmd_value(const struct patch *p, const char *dev, const char *serial, uint8_t *buf)
+{
+    char line[PATCH_LINE_MAX];
+    FILE *f;
+    int ok;
+
+#ifndef _WIN32
+    setenv("ICEPROG_DEVICE", dev, 1);
+    setenv("ICEPROG_SERIAL", serial, 1);
+#endif
+    fflush(stdout);
+    f = popen(p->arg, "r");
+    if (!f) {
+        fprintf(stderr, "can't run `%s': %s\n", p->arg, strerror(errno));
+        return 1;
+    }
+    ok = fgets(line, sizeof(line), f) != NULL;
+    while (fgetc(f) != EOF)
+        ;
+    if (pclose(f) != 0 || !ok) {
+        fprintf(stderr, "`%s' failed\n", p->arg);
+        return 1;
+    }
+    if (parse_hex(line, buf, p->length)) {
+        line[strcspn(line, "\r\n")] = 0;
+        fprintf(stderr, "`%s': `%s' is not %u hex bytes\n", p->arg, line, p->length);
+        return 1;
+    }
+    return 0;
+}
+
+int patch_value(const struct patch *p, const char *dev, const char *serial, uint8_t *buf)
+{
+    switch (p->source) {
+    case PATCH_COUNTER:
+        return counter_value(p, buf);
+    case PATCH_CSV:
+        return csv_value(p, buf);
+    case PATCH_CMD:
+        return cmd_value(p, dev, serial, buf);
+    }
+    return 1;
+}
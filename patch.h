@@ -0,0 +1,55 @@
+/*
+ *  iceprog -- simple programming tool for Lattice iCE FPGA
+ *
+ *  Copyright (C) 2015  Clifford Wolf <clifford@clifford.at>
+ *  Copyright (C) 2018  Piotr Esden-Tempski <piotr@esden.net>
+ *  Copyright (C) 2018  Daniel Serpell <daniel.serpell@gmail.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/*
+ * patch.h: Per-board fields patched into the image.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Largest patch field, in bytes */
+#define PATCH_MAX 256
+
+enum patch_source {
+    PATCH_COUNTER,  /* counter:<file>, the number in the file, incremented */
+    PATCH_CSV,      /* csv:<file>[:<column>], hex bytes from the next row */
+    PATCH_CMD,      /* cmd:<command>, hex bytes from the command output */
+};
+
+struct patch {
+    uint32_t offset;
+    uint32_t length;
+    enum patch_source source;
+    const char *arg;    /* file name or command */
+    int column;         /* CSV column, from 1 */
+};
+
+/* Parses the source of a patch field, as in "counter:serial.txt". Returns
+ * 0 on success. */
+int patch_parse_source(char *spec, struct patch *p);
+
+/* Gets the field value for the next board into "buf", taking the counter
+ * value or CSV row so no other board gets it. Commands get the programmer
+ * device and USB serial number in ICEPROG_DEVICE and ICEPROG_SERIAL.
+ * Returns 0 on success. */
+int patch_value(const struct patch *p, const char *dev, const char *serial, uint8_t *buf);
@@ -30,12 +30,21 @@
 #include <sys/stat.h>
 #include <termios.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <libgen.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include "serial.h"
 
 static int serial_fd;
 
 #ifdef __linux
 
 #include <sys/ioctl.h>
+#include <linux/serial.h>
 // Copied from Linux kernel headers, to support missing
 // arbitrary baud rates in GLIBC.
 #define LINUX_NCCS 19
@@ -67,7 +76,7 @@ static int linux_tcgetattr(int fd, const struct linux_termios2 *t)
 }
 #endif
 
-static int serialport_config(int baud)
+static int serialport_config(int fd, int baud)
 {
     struct termios2 tty;
     memset(&tty, 0, sizeof tty);
@@ -83,16 +92,104 @@ static int serialport_config(int baud)
     tty.c_cflag |= CBAUDEX;
     tty.c_ispeed = tty.c_ospeed = baud;
 
-    if (linux_tcsetattr(serial_fd, TCSANOW, &tty) != 0) {
+    if (linux_tcsetattr(fd, TCSANOW, &tty) != 0) {
         fprintf(stderr, "error %d from tcsetattr", errno);
         return -1;
     }
     return 0;
 }
 
+/* Settings changed by tty_low_latency(), they outlive the process so they
+ * are put back by tty_close() */
+static int saved_low_latency;
+static char saved_latency_path[256], saved_latency_timer[16];
+
+// Sets the USB-serial adapter latency timer (FTDI and similar) to 1 ms
+static int serialport_set_latency_timer(void)
+{
+    const char *tty = ttyname(serial_fd);
+    char path[256], old[16];
+    int fd, n, ret = 0;
+
+    if (!tty || !strrchr(tty, '/'))
+        return -1;
+    snprintf(path, sizeof(path), "/sys/class/tty/%s/device/latency_timer", strrchr(tty, '/') + 1);
+
+    fd = open(path, O_RDWR);
+    if (fd < 0)
+        return -1;
+    n = read(fd, old, sizeof(old) - 1);
+    if (n > 0 && lseek(fd, 0, SEEK_SET) == 0) {
+        old[n] = 0;
+        old[strcspn(old, "\n")] = 0;
+    } else
+        old[0] = 0;
+    if (write(fd, "1", 1) != 1)
+        ret = -1;
+    else if (old[0] && strcmp(old, "1")) {
+        strcpy(saved_latency_path, path);
+        strcpy(saved_latency_timer, old);
+    }
+    close(fd);
+    return ret;
+}
+
+static void tty_restore_latency(void)
+{
+    struct serial_struct ss;
+    int fd;
+
+    if (saved_low_latency && ioctl(serial_fd, TIOCGSERIAL, &ss) == 0) {
+        ss.flags &= ~ASYNC_LOW_LATENCY;
+        ioctl(serial_fd, TIOCSSERIAL, &ss);
+    }
+    saved_low_latency = 0;
+
+    if (saved_latency_timer[0] && (fd = open(saved_latency_path, O_WRONLY)) >= 0) {
+        if (write(fd, saved_latency_timer, strlen(saved_latency_timer)) < 0)
+            fprintf(stderr, "can't restore USB latency timer: %s\n", strerror(errno));
+        close(fd);
+    }
+    saved_latency_timer[0] = 0;
+}
+
+static int tty_low_latency(void)
+{
+    struct serial_struct ss;
+    int ret = 0;
+
+    if (ioctl(serial_fd, TIOCGSERIAL, &ss) == 0) {
+        if (!(ss.flags & ASYNC_LOW_LATENCY)) {
+            ss.flags |= ASYNC_LOW_LATENCY;
+            if (ioctl(serial_fd, TIOCSSERIAL, &ss) != 0) {
+                fprintf(stderr, "can't set serial port low latency mode: %s\n", strerror(errno));
+                ret = 1;
+            } else
+                saved_low_latency = 1;
+        }
+    } else {
+        fprintf(stderr, "serial port does not support low latency mode\n");
+        ret = 1;
+    }
+
+    if (serialport_set_latency_timer() != 0) {
+        if (errno != ENOENT)
+            fprintf(stderr, "can't set USB latency timer: %s\n", strerror(errno));
+        ret = 1;
+    }
+
+    // Also put the settings back when exiting on an error
+    static int registered;
+    if (!registered++)
+        atexit(tty_restore_latency);
+
+    // The tty layer buffers are fixed by the kernel, nothing to size here.
+    return ret;
+}
+
 #endif // __linux
 
-int serialport_read(unsigned char *buf, unsigned int readcnt)
+static int tty_read(unsigned char *buf, unsigned int readcnt)
 {
         ssize_t tmp = 0;
 
@@ -112,7 +209,43 @@ int serialport_read(unsigned char *buf, unsigned int readcnt)
 }
 
 
-int serialport_write(const unsigned char *buf, unsigned int writecnt)
+static int tty_read_timeout(unsigned char *buf, unsigned int readcnt, int timeout_ms)
+{
+        ssize_t tmp = 0;
+
+        while (readcnt > 0) {
+                struct pollfd pfd = { .fd = serial_fd, .events = POLLIN };
+                int rc = poll(&pfd, 1, timeout_ms);
+                if (rc == -1) {
+                        fprintf(stderr, "Serial port poll error!\n");
+                        return 1;
+                }
+                if (!rc)
+                        return 1;
+                /* After a hangup, poll() returns at once and read() returns 0 */
+                if (pfd.revents & (POLLHUP | POLLERR) && !(pfd.revents & POLLIN)) {
+                        fprintf(stderr, "Serial port hung up!\n");
+                        return 1;
+                }
+                tmp = read(serial_fd, buf, readcnt);
+                if (tmp <= 0) {
+                        fprintf(stderr, "Serial port read error%s\n", tmp ? "!" : ", device disconnected");
+                        return 1;
+                }
+                readcnt -= tmp;
+                buf += tmp;
+        }
+
+        return 0;
+}
+
+static void tty_flush_input(void)
+{
+        tcflush(serial_fd, TCIFLUSH);
+}
+
+
+static int tty_write(const unsigned char *buf, unsigned int writecnt)
 {
         ssize_t tmp = 0;
         unsigned int empty_writes = 250; /* results in a ca. 125ms timeout */
@@ -140,7 +273,7 @@ int serialport_write(const unsigned char *buf, unsigned int writecnt)
 }
 
 
-int serialport_open(const char *dev, int baud)
+static int tty_open(const char *dev, int baud)
 {
         serial_fd = open(dev, O_RDWR | O_NOCTTY | O_NDELAY); // Use O_NDELAY to ignore DCD state
         if (serial_fd < 0) {
@@ -158,7 +291,7 @@ int serialport_open(const char *dev, int baud)
                 fprintf(stderr, "Error: cannot set serial port to blocking: %s\n", strerror(errno));
                 goto err;
         }
-        if (serialport_config(baud) != 0) {
+        if (serialport_config(serial_fd, baud) != 0) {
                 goto err;
         }
         return 0;
@@ -167,13 +300,154 @@ err:
         return 1;
 }
 
-void serialport_close(void)
+static int tty_set_baud(int baud)
+{
+        return serialport_config(serial_fd, baud);
+}
+
+static void tty_close(void)
 {
+    tty_restore_latency();
     close( serial_fd );
 }
 
+static const struct serial_transport tty_transport = {
+    .open = tty_open,
+    .read = tty_read,
+    .read_timeout = tty_read_timeout,
+    .write = tty_write,
+    .flush_input = tty_flush_input,
+    .set_baud = tty_set_baud,
+    .low_latency = tty_low_latency,
+    .close = tty_close,
+};
+
 const char *serialport_get_default_device(void)
 {
     static char dev_default[64] = "/dev/ttyACM0";
     return dev_default;
 }
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(a, b);
+}
+
+int serialport_list_devices(char list[][SERIAL_NAME_MAX], int max)
+{
+    const char *base = "/dev/serial/by-id";
+    DIR *dir = opendir(base);
+    struct dirent *e;
+    int count = 0;
+
+    if (!dir)
+        return 0;
+    while ((e = readdir(dir)) != NULL && count < max) {
+        char path[PATH_MAX];
+        if (e->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", base, e->d_name);
+        if (strlen(path) < SERIAL_NAME_MAX)
+            strcpy(list[count++], path);
+    }
+    closedir(dir);
+    qsort(list, count, SERIAL_NAME_MAX, compare_names);
+    return count;
+}
+
+int serialport_probe(const char *dev, int baud, const unsigned char *req, unsigned int reqlen,
+                     unsigned char *ans, unsigned int anslen, int timeout_ms)
+{
+    struct timespec now, end;
+    int fd, ret = 1;
+
+    fd = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0)
+        return 1;
+    if (!isatty(fd) || serialport_config(fd, baud) != 0)
+        goto out;
+    tcflush(fd, TCIOFLUSH);
+    if (write(fd, req, reqlen) != (ssize_t)reqlen)
+        goto out;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += timeout_ms / 1000;
+    end.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    while (anslen > 0) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        ssize_t n;
+        int left;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = (end.tv_sec - now.tv_sec) * 1000 + (end.tv_nsec - now.tv_nsec) / 1000000;
+        if (left <= 0 || poll(&pfd, 1, left) <= 0)
+            goto out;
+        n = read(fd, ans, anslen);
+        if (n <= 0)
+            goto out;
+        ans += n;
+        anslen -= n;
+    }
+    ret = 0;
+out:
+    close(fd);
+    return ret;
+}
+
+int serialport_get_serial(const char *dev, char *buf, int size)
+{
+    // The serial number is in the USB device, one level up from the
+    // interface of ACM ports and two levels up for USB serial converters.
+    static const char *paths[] = { "device/../serial", "device/../../serial" };
+    char real[PATH_MAX];
+
+    if (!realpath(dev, real))
+        return 1;
+    for (int i = 0; i < 2; i++) {
+        char path[PATH_MAX + 64];
+        FILE *f;
+
+        snprintf(path, sizeof(path), "/sys/class/tty/%s/%s", basename(real), paths[i]);
+        f = fopen(path, "r");
+        if (!f)
+            continue;
+        if (fgets(buf, size, f)) {
+            fclose(f);
+            buf[strcspn(buf, "\r\n")] = 0;
+            return buf[0] == 0;
+        }
+        fclose(f);
+    }
+    return 1;
+}
+
+static int watch_fd = -1, watch_byid = -1;
+
+int serialport_watch_start(void)
+{
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd < 0)
+        return 1;
+    if (inotify_add_watch(watch_fd, "/dev", IN_CREATE | IN_DELETE) < 0) {
+        close(watch_fd);
+        watch_fd = -1;
+        return 1;
+    }
+    watch_byid = inotify_add_watch(watch_fd, "/dev/serial/by-id", IN_CREATE | IN_DELETE);
+    return 0;
+}
+
+int serialport_watch_wait(int timeout_ms)
+{
+    struct pollfd pfd = { .fd = watch_fd, .events = POLLIN };
+    char buf[4096];
+
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+        return 0;
+    while (read(watch_fd, buf, sizeof(buf)) > 0)
+        ;
+    // udev creates the by-id directory with the first USB serial device
+    if (watch_byid < 0)
+        watch_byid = inotify_add_watch(watch_fd, "/dev/serial/by-id", IN_CREATE | IN_DELETE);
+    return 1;
+}
@@ -0,0 +1,192 @@
+/*
+ *  iceprog -- simple programming tool for Lattice iCE FPGA
+ *
+ *  Copyright (C) 2015  Clifford Wolf <clifford@clifford.at>
+ *  Copyright (C) 2018  Piotr Esden-Tempski <piotr@esden.net>
+ *  Copyright (C) 2018  Daniel Serpell <daniel.serpell@gmail.com>
+ *
+ *  Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ *  WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ *  ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ *  OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+/* Serial port functions for TCP connected programmers */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef _WIN32
+# include <winsock2.h>
+# include <ws2tcpip.h>
+typedef SOCKET tcp_socket_t;
+# define TCP_INVALID INVALID_SOCKET
+# define tcp_closesocket closesocket
+#else
+# include <unistd.h>
+# include <poll.h>
+# include <netdb.h>
+# include <sys/socket.h>
+# include <netinet/in.h>
+# include <netinet/tcp.h>
+typedef int tcp_socket_t;
+# define TCP_INVALID (-1)
+# define tcp_closesocket close
+#endif
+#include "serial.h"
+
+static tcp_socket_t tcp_fd = TCP_INVALID;
+
+// Waits until the socket has data, returns 0 on timeout.
+static int tcp_wait(int timeout_ms)
+{
+#ifdef _WIN32
+    fd_set fds;
+    struct timeval tv = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+    FD_ZERO(&fds);
+    FD_SET(tcp_fd, &fds);
+    return select(0, &fds, NULL, NULL, timeout_ms < 0 ? NULL : &tv);
+#else
+    struct pollfd pfd = { .fd = tcp_fd, .events = POLLIN };
+    return poll(&pfd, 1, timeout_ms);
+#endif
+}
+
+static int tcp_read(unsigned char *buf, unsigned int readcnt)
+{
+    while (readcnt > 0) {
+        int tmp = recv(tcp_fd, (char *)buf, readcnt, 0);
+        if (tmp <= 0) {
+            fprintf(stderr, "Network read error%s\n", tmp ? "!" : ", connection closed");
+            return 1;
+        }
+        readcnt -= tmp;
+        buf += tmp;
+    }
+    return 0;
+}
+
+static int tcp_read_timeout(unsigned char *buf, unsigned int readcnt, int timeout_ms)
+{
+    while (readcnt > 0) {
+        int rc = tcp_wait(timeout_ms);
+        if (rc < 0) {
+            fprintf(stderr, "Network poll error!\n");
+            return 1;
+        }
+        if (!rc)
+            return 1;
+        int tmp = recv(tcp_fd, (char *)buf, readcnt, 0);
+        if (tmp <= 0) {
+            fprintf(stderr, "Network read error%s\n", tmp ? "!" : ", connection closed");
+            return 1;
+        }
+        readcnt -= tmp;
+        buf += tmp;
+    }
+    return 0;
+}
+
+static void tcp_flush_input(void)
+{
+    char buf[256];
+    while (tcp_wait(0) > 0)
+        if (recv(tcp_fd, buf, sizeof(buf), 0) <= 0)
+            break;
+}
+
+static int tcp_write(const unsigned char *buf, unsigned int writecnt)
+{
+    while (writecnt > 0) {
+        int tmp = send(tcp_fd, (const char *)buf, writecnt, 0);
+        if (tmp <= 0) {
+            fprintf(stderr, "Network write error!\n");
+            return 1;
+        }
+        writecnt -= tmp;
+        buf += tmp;
+    }
+    return 0;
+}
+
+// Opens a connection to "host:port", the baud rate is ignored.
+static int tcp_open(const char *dev, int baud)
+{
+    struct addrinfo hints, *res, *ai;
+    char host[256];
+    const char *port = strrchr(dev, ':');
+    int one = 1, rc;
+
+    if (!port || port == dev || (size_t)(port - dev) >= sizeof(host)) {
+        fprintf(stderr, "Error: invalid network address '%s', expected host:port\n", dev);
+        return 1;
+    }
+    memcpy(host, dev, port - dev);
+    host[port - dev] = 0;
+    port++;
+
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa)) {
+        fprintf(stderr, "Error: cannot initialize network\n");
+        return 1;
+    }
+#endif
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    rc = getaddrinfo(host, port, &hints, &res);
+    if (rc) {
+        fprintf(stderr, "Error: cannot resolve '%s': %s\n", host, gai_strerror(rc));
+        return 1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        tcp_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (tcp_fd == TCP_INVALID)
+            continue;
+        if (connect(tcp_fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        tcp_closesocket(tcp_fd);
+        tcp_fd = TCP_INVALID;
+    }
+    freeaddrinfo(res);
+
+    if (tcp_fd == TCP_INVALID) {
+        fprintf(stderr, "Error: cannot connect to %s: %s\n", dev, strerror(errno));
+        return 1;
+    }
+
+    // Commands are already batched, send each batch right away.
+    if (setsockopt(tcp_fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&one, sizeof(one)))
+        fprintf(stderr, "Warning: cannot set TCP_NODELAY: %s\n", strerror(errno));
+
+    return 0;
+}
+
+static void tcp_close(void)
+{
+    tcp_closesocket(tcp_fd);
+    tcp_fd = TCP_INVALID;
+}
+
+static const struct serial_transport tcp_transport = {
+    .open = tcp_open,
+    .read = tcp_read,
+    .read_timeout = tcp_read_timeout,
+    .write = tcp_write,
+    .flush_input = tcp_flush_input,
+    .set_baud = NULL,
+    .low_latency = NULL,
+    .close = tcp_close,
+};
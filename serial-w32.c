@@ -23,6 +23,7 @@
 
 #include <windows.h>
 #include <stdio.h>
+#include "serial.h"
 
 static HANDLE serial_hnd;
 
@@ -39,7 +40,7 @@ static const char *get_system_error()
         return "unknown system error";
 }
 
-static int serialport_config(int baud)
+static int serialport_config(HANDLE hnd, int baud)
 {
     DCB serialParameters;
     COMMTIMEOUTS timeOut;
@@ -73,7 +74,7 @@ static int serialport_config(int baud)
     serialParameters.EofChar           = 0;
     serialParameters.EvtChar           = 0;
     serialParameters.wReserved1        = 0;
-    if( 0 == SetCommState(serial_hnd, &serialParameters) )
+    if( 0 == SetCommState(hnd, &serialParameters) )
     {
         fprintf(stderr, "Can't set serial port parameters: %s\n", get_system_error());
         return 1;
@@ -85,7 +86,7 @@ static int serialport_config(int baud)
     timeOut.ReadTotalTimeoutConstant    = 400;
     timeOut.WriteTotalTimeoutMultiplier = 1;
     timeOut.WriteTotalTimeoutConstant   = 100;
-    if( 0 == SetCommTimeouts(serial_hnd, &timeOut) )
+    if( 0 == SetCommTimeouts(hnd, &timeOut) )
     {
         fprintf(stderr, "Can't set serial port timeouts: %s\n", get_system_error());
         return 1;
@@ -94,7 +95,7 @@ static int serialport_config(int baud)
     return 0;
 }
 
-int serialport_read(unsigned char *buf, unsigned int readcnt)
+static int tty_read(unsigned char *buf, unsigned int readcnt)
 {
     unsigned int empty_reads = 10; /* results in a 5s timeout */
     DWORD tmp;
@@ -120,8 +121,34 @@ int serialport_read(unsigned char *buf, unsigned int readcnt)
     return 0;
 }
 
+static int tty_read_timeout(unsigned char *buf, unsigned int readcnt, int timeout_ms)
+{
+    DWORD start = GetTickCount();
+    DWORD tmp;
+    while(readcnt > 0)
+    {
+        if (!ReadFile(serial_hnd, buf, readcnt, &tmp, 0))
+        {
+            fprintf(stderr, "Serial port read error: %s\n", get_system_error());
+            return 1;
+        }
+        if (tmp)
+            start = GetTickCount();
+        else if (GetTickCount() - start >= (DWORD)timeout_ms)
+            return 1;
+        readcnt -= tmp;
+        buf += tmp;
+    }
+    return 0;
+}
 
-int serialport_write(const unsigned char *buf, unsigned int writecnt)
+static void tty_flush_input(void)
+{
+    PurgeComm(serial_hnd, PURGE_RXCLEAR);
+}
+
+
+static int tty_write(const unsigned char *buf, unsigned int writecnt)
 {
     DWORD tmp;
     unsigned int empty_writes = 10; /* results in a ca. 10s timeout */
@@ -152,7 +179,7 @@ int serialport_write(const unsigned char *buf, unsigned int writecnt)
 }
 
 
-int serialport_open(const char *dev, int baud)
+static int tty_open(const char *dev, int baud)
 {
     // Open the device
     serial_hnd = CreateFile(TEXT(dev), GENERIC_READ | GENERIC_WRITE,
@@ -166,7 +193,7 @@ int serialport_open(const char *dev, int baud)
         return 1;
     }
 
-    if (serialport_config(baud) != 0)
+    if (serialport_config(serial_hnd, baud) != 0)
     {
         CloseHandle(serial_hnd);
         return 1;
@@ -174,11 +201,39 @@ int serialport_open(const char *dev, int baud)
     return 0;
 }
 
-void serialport_close(void)
+static int tty_low_latency(void)
+{
+    // Make the driver buffers big enough to hold many queued commands; the
+    // USB latency timer can only be changed in the driver configuration.
+    if( !SetupComm(serial_hnd, 65536, 65536) )
+    {
+        fprintf(stderr, "Can't set serial port buffer sizes: %s\n", get_system_error());
+        return 1;
+    }
+    return 0;
+}
+
+static int tty_set_baud(int baud)
+{
+    return serialport_config(serial_hnd, baud);
+}
+
+static void tty_close(void)
 {
     CloseHandle(serial_hnd);
 }
 
+static const struct serial_transport tty_transport = {
+    .open = tty_open,
+    .read = tty_read,
+    .read_timeout = tty_read_timeout,
+    .write = tty_write,
+    .flush_input = tty_flush_input,
+    .set_baud = tty_set_baud,
+    .low_latency = tty_low_latency,
+    .close = tty_close,
+};
+
 const char *serialport_get_default_device(void)
 {
     static char dev_default[64] = "COM1";
@@ -211,3 +266,63 @@ const char *serialport_get_default_device(void)
     fprintf(stderr,"Selected device: %s\n", dev_default);
     return dev_default;
 }
+
+int serialport_list_devices(char list[][SERIAL_NAME_MAX], int max)
+{
+    char dev_path[4096];
+    int count = 0;
+
+    for (int i=0; i<256 && count<max; i++)
+    {
+        char dev_name[64];
+        sprintf(dev_name, "COM%d", i);
+        if( 0 != QueryDosDevice(dev_name, dev_path, sizeof(dev_path)) &&
+            !strncasecmp(dev_path, "\\device\\usb", 11) )
+            snprintf(list[count++], SERIAL_NAME_MAX, "\\\\.\\%s", dev_name);
+    }
+    return count;
+}
+
+int serialport_probe(const char *dev, int baud, const unsigned char *req, unsigned int reqlen,
+                     unsigned char *ans, unsigned int anslen, int timeout_ms)
+{
+    COMMTIMEOUTS timeOut;
+    DWORD n;
+    int ret = 1;
+    HANDLE hnd = CreateFile(TEXT(dev), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                            OPEN_EXISTING, 0, NULL);
+    if (hnd == INVALID_HANDLE_VALUE)
+        return 1;
+
+    if (serialport_config(hnd, baud) == 0)
+    {
+        ZeroMemory(&timeOut, sizeof(COMMTIMEOUTS));
+        timeOut.ReadTotalTimeoutConstant  = timeout_ms;
+        timeOut.WriteTotalTimeoutConstant = timeout_ms;
+        PurgeComm(hnd, PURGE_RXCLEAR | PURGE_TXCLEAR);
+        if( SetCommTimeouts(hnd, &timeOut) &&
+            WriteFile(hnd, req, reqlen, &n, NULL) && n == reqlen &&
+            ReadFile(hnd, ans, anslen, &n, NULL) && n == anslen )
+            ret = 0;
+    }
+    CloseHandle(hnd);
+    return ret;
+}
+
+int serialport_get_serial(const char *dev, char *buf, int size)
+{
+    // Not available from the COM port name
+    return 1;
+}
+
+int serialport_watch_start(void)
+{
+    // Device notifications need a window, not supported
+    return 1;
+}
+
+int serialport_watch_wait(int timeout_ms)
+{
+    Sleep(timeout_ms);
+    return 1;
+}
@@ -20,9 +20,66 @@
  */
 
 /* Selects between OS implementations */
+#ifdef _WIN32
+/* winsock2.h for serial-tcp.c must come before windows.h */
+# include <winsock2.h>
+#endif
 #ifdef __linux
 # include "serial-lnx.c"
 #elif _WIN32
 # include "serial-w32.c"
 #endif
 
+#include "serial-tcp.c"
+
+static const struct serial_transport *transport = &tty_transport;
+
+int serialport_open(const char *dev, int baud)
+{
+    if (!strncmp(dev, "tcp:", 4)) {
+        transport = &tcp_transport;
+        dev += 4;
+    } else
+        transport = &tty_transport;
+    return transport->open(dev, baud);
+}
+
+int serialport_read(unsigned char *buf, unsigned int readcnt)
+{
+    return transport->read(buf, readcnt);
+}
+
+int serialport_read_timeout(unsigned char *buf, unsigned int readcnt, int timeout_ms)
+{
+    return transport->read_timeout(buf, readcnt, timeout_ms);
+}
+
+void serialport_flush_input(void)
+{
+    transport->flush_input();
+}
+
+int serialport_write(const unsigned char *buf, unsigned int writecnt)
+{
+    return transport->write(buf, writecnt);
+}
+
+int serialport_set_baud(int baud)
+{
+    // Not a serial line, there is no baud rate to set
+    if (!transport->set_baud)
+        return -1;
+    return transport->set_baud(baud);
+}
+
+int serialport_low_latency(void)
+{
+    if (!transport->low_latency)
+        return 0;
+    return transport->low_latency();
+}
+
+void serialport_close(void)
+{
+    transport->close();
+}
@@ -25,17 +25,69 @@
 
 #pragma once
 
+/* Transport backend, the serial port functions below forward to the
+ * backend selected by serialport_open(). */
+struct serial_transport {
+    int (*open)(const char *dev, int baud);
+    int (*read)(unsigned char *buf, unsigned int readcnt);
+    int (*read_timeout)(unsigned char *buf, unsigned int readcnt, int timeout_ms);
+    int (*write)(const unsigned char *buf, unsigned int writecnt);
+    void (*flush_input)(void);
+    int (*set_baud)(int baud);       /* NULL if not applicable */
+    int (*low_latency)(void);        /* NULL if not applicable */
+    void (*close)(void);
+};
+
 /*  Reads "readcnt" bytes from serial port. */
 int serialport_read(unsigned char *buf, unsigned int readcnt);
 
+/*  Reads "readcnt" bytes from serial port, waiting at most "timeout_ms"
+ *  milliseconds for each chunk of data. Returns 1 on timeout. */
+int serialport_read_timeout(unsigned char *buf, unsigned int readcnt, int timeout_ms);
+
+/*  Discards all received data not read yet. */
+void serialport_flush_input(void);
+
 /*  Writes "writecnt" bytes from serial port. */
 int serialport_write(const unsigned char *buf, unsigned int writecnt);
 
-/*  Opens serial device and sets baud rate. */
+/*  Opens serial device and sets baud rate. A device string of the form
+ *  "tcp:host:port" connects to a network serprog programmer instead. */
 int serialport_open(const char *dev, int baud);
 
+/*  Changes the baud rate of an open serial port. Returns 0 on success, 1 on
+ *  error, or -1 if the link (a network connection) has no baud rate. */
+int serialport_set_baud(int baud);
+
+/*  Tunes the serial port for low latency, returns 1 if some setting is not
+ *  supported. The port keeps working in that case. */
+int serialport_low_latency(void);
+
 /*  Closes serial port. */
 void serialport_close(void);
 
 /* Returns default serial device */
 const char *serialport_get_default_device(void);
+
+/* Maximum length of a device name */
+#define SERIAL_NAME_MAX 256
+
+/*  Lists the USB serial devices, up to "max". Returns the number found. */
+int serialport_list_devices(char list[][SERIAL_NAME_MAX], int max);
+
+/*  Opens "dev" apart from the current serial port, sends "req" and reads
+ *  "anslen" bytes of answer within "timeout_ms" milliseconds. Returns 0 if
+ *  the answer was received. Can be called from many threads at once. */
+int serialport_probe(const char *dev, int baud, const unsigned char *req, unsigned int reqlen,
+                     unsigned char *ans, unsigned int anslen, int timeout_ms);
+
+/*  Gets the USB serial number of the device, returns 0 on success. */
+int serialport_get_serial(const char *dev, char *buf, int size);
+
+/*  Starts watching for USB serial devices being plugged in or out.
+ *  Returns 0 on success. */
+int serialport_watch_start(void);
+
+/*  Waits at most "timeout_ms" milliseconds for USB serial devices to be
+ *  plugged in or out. Returns 1 if the device list may have changed. */
+int serialport_watch_wait(int timeout_ms);
@@ -30,6 +30,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/time.h>
+#include <pthread.h>
 #include "serial.h"
 #include "serprog.h"
 
@@ -59,44 +61,392 @@
 #define S_CMD_S_SPI_FREQ	0x14	/* Set SPI clock frequency			*/
 #define S_CMD_S_PIN_STATE	0x15	/* Enable/disable output drivers		*/
 
-static int sp_docommand(uint8_t command, uint32_t parmlen,
-                        uint8_t *params, uint32_t retlen, void *retparms)
+/* iceprog extensions, only used when advertised in the command map */
+#define S_CMD_O_SPIOP_RLE	0x30	/* Perform SPI operation, compressed payload	*/
+#define S_CMD_S_GPIO		0x31	/* Set CRESET and chip select control		*/
+#define S_CMD_Q_GPIO		0x32	/* Query CDONE					*/
+
+/* Don't bother compressing payloads smaller than this */
+#define SP_RLE_MIN_LEN		16
+
+static struct serprog_caps sp_caps;
+static struct serprog_stats sp_stats;
+
+/* Time to wait for an answer before trying to resync, and number of
+ * retries */
+#define SP_TIMEOUT_MS		1000
+#define SP_MAX_RETRIES		3
+
+/* Maximum number of commands waiting for an answer */
+#define SP_QUEUE_MAX		64
+
+/* A command sent to the programmer that was not answered yet */
+struct sp_pending {
+        uint8_t command;
+        uint32_t retlen;
+        void *retparms;
+};
+
+static struct sp_pending sp_queue[SP_QUEUE_MAX];
+static unsigned sp_queue_len;
+static uint8_t *sp_txbuf;
+static uint32_t sp_txlen, sp_txsize;
+/* Size of the programmer receive buffer, the protocol specifies 16 bytes
+ * as the minimum if S_CMD_Q_SERBUF is not supported. */
+static uint32_t sp_serbuf = 16;
+/* Maximum read length of one SPI operation, 0 if unlimited */
+static uint32_t sp_max_read;
+
+/* Largest chunk read by one SPI operation, and fraction of the answer
+ * timeout that the transfer of one chunk may take */
+#define SP_CHUNK_MAX		0x10000
+#define SP_CHUNK_MIN		256
+#define SP_CHUNK_TIME		0.25
+/* Bulk transfers averaged before comparing the throughput with the
+ * profile */
+#define SP_WATCH_FLUSHES	8
+
+static struct serprog_link sp_link = { 0, 0, SP_CHUNK_MAX, SP_QUEUE_MAX };
+static int sp_profiling, sp_retune;
+/* Set while the GPIO extension holds the chip select, the SPI operations
+ * are then parts of one stream, like the SRAM bitstream, and can't be
+ * sent again */
+static int sp_stream;
+static unsigned sp_watch_count;
+static double sp_watch_bytes, sp_watch_time;
+
+static double sp_time(void)
 {
-        unsigned char c;
-        if (serialport_write(&command, 1) != 0) {
-                fprintf(stderr, "Error: cannot write op code: %s\n", strerror(errno));
-                return 1;
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+/* Result of sending the queued commands */
+#define SP_OK		0
+#define SP_NAK		1	/* Some command was rejected by the programmer */
+#define SP_DESYNC	2	/* Lost data or invalid answer, must resync */
+
+/* Sends all queued commands and reads the answers */
+static int sp_send_queue(void)
+{
+        int ret = SP_OK;
+
+        if (serialport_write(sp_txbuf, sp_txlen) != 0) {
+                fprintf(stderr, "Error: cannot write command: %s\n", strerror(errno));
+                return SP_DESYNC;
         }
-        if (serialport_write(params, parmlen) != 0) {
-                fprintf(stderr, "Error: cannot write parameters: %s\n", strerror(errno));
-                return 1;
+        for (unsigned i = 0; i < sp_queue_len; i++) {
+                struct sp_pending *p = &sp_queue[i];
+                unsigned char c;
+                if (serialport_read_timeout(&c, 1, SP_TIMEOUT_MS) != 0) {
+                        fprintf(stderr, "Error: no answer from device (to command 0x%02X)\n", p->command);
+                        return SP_DESYNC;
+                }
+                if (c == S_NAK) {
+                        ret = SP_NAK;
+                        continue;
+                }
+                if (c != S_ACK) {
+                        fprintf(stderr, "Error: invalid response 0x%02X from device (to command 0x%02X)\n", c, p->command);
+                        return SP_DESYNC;
+                }
+                if (p->retlen) {
+                        if (serialport_read_timeout(p->retparms, p->retlen, SP_TIMEOUT_MS) != 0) {
+                                fprintf(stderr, "Error: cannot read return parameters (to command 0x%02X)\n", p->command);
+                                return SP_DESYNC;
+                        }
+                }
         }
-        if (serialport_read(&c, 1) != 0) {
-                fprintf(stderr, "Error: cannot read from device: %s\n", strerror(errno));
-                return 1;
+        return ret;
+}
+
+/* Accumulates the throughput of bulk reads, asking for a new link profile
+ * when it drops well below the one expected from the last profile */
+static void sp_watch_throughput(uint32_t bytes, double t)
+{
+        double batch, expected;
+
+        if (sp_profiling || !sp_link.bandwidth || bytes < sp_link.chunk)
+                return;
+        sp_watch_bytes += bytes;
+        sp_watch_time += t;
+        if (++sp_watch_count < SP_WATCH_FLUSHES)
+                return;
+
+        batch = (double)sp_link.chunk * sp_link.depth;
+        expected = batch / (sp_link.rtt + batch / sp_link.bandwidth);
+        if (sp_watch_bytes < expected * sp_watch_time / 2) {
+                fprintf(stderr, "link throughput dropped to %.1f kB/s, retuning\n",
+                        0.001 * sp_watch_bytes / sp_watch_time);
+                sp_retune = 1;
         }
-        if (c == S_NAK)
-                return 1;
-        if (c != S_ACK) {
-                fprintf(stderr, "Error: invalid response 0x%02X from device (to command 0x%02X)\n", c, command);
-                return 1;
+        sp_watch_count = 0;
+        sp_watch_bytes = sp_watch_time = 0;
+}
+
+/* Sends all queued commands, on errors resynchronizes with the programmer
+ * and sends all of them again. Flash operations can be repeated: erasing or
+ * programming the same data twice gives the same result, and the written
+ * data is checked by the final verify. A stream sent with the chip select
+ * held (SRAM programming) would be corrupted by repeating a part of it, so
+ * it is never sent again. */
+static int sp_flush(void)
+{
+        int ret, tries = 0;
+        double start, last_try;
+        uint32_t rx = 0;
+
+        if (!sp_queue_len)
+                return 0;
+        sp_stats.flushes++;
+        for (unsigned i = 0; i < sp_queue_len; i++)
+                rx += sp_queue[i].retlen;
+
+        start = last_try = sp_time();
+        while ((ret = sp_send_queue()) == SP_DESYNC && tries < SP_MAX_RETRIES) {
+                if (sp_stream) {
+                        fprintf(stderr, "Error: lost sync with programmer in the middle of a stream\n");
+                        serprog_sync();
+                        break;
+                }
+                tries++;
+                sp_stats.retries++;
+                fprintf(stderr, "Warning: lost sync with programmer, retrying (%d/%d)\n",
+                        tries, SP_MAX_RETRIES);
+                if (serprog_sync())
+                        fprintf(stderr, "Warning: can't resync with programmer\n");
+                last_try = sp_time();
+        }
+        sp_stats.retry_time += last_try - start;
+
+        sp_queue_len = 0;
+        sp_txlen = 0;
+        sp_stats.io_time += sp_time() - start;
+        if (ret == SP_OK && !tries)
+                sp_watch_throughput(rx, sp_time() - start);
+        return ret != SP_OK;
+}
+
+/* Adds a command to the queue, sending the queue first if the programmer
+ * buffer could overflow. The return parameters are stored in "retparms" by
+ * the next sp_flush(). */
+static int sp_queue_command(uint8_t command, uint32_t parmlen,
+                            const uint8_t *params, uint32_t retlen, void *retparms)
+{
+        if (sp_queue_len == SP_QUEUE_MAX ||
+            (sp_queue_len && sp_txlen + 1 + parmlen > sp_serbuf)) {
+                if (sp_flush())
+                        return 1;
         }
-        if (retlen) {
-                if (serialport_read(retparms, retlen) != 0) {
-                        fprintf(stderr, "Error: cannot read return parameters: %s\n", strerror(errno));
+
+        if (sp_txlen + 1 + parmlen > sp_txsize) {
+                uint32_t size = sp_txlen + 1 + parmlen + 1024;
+                uint8_t *buf = realloc(sp_txbuf, size);
+                if (!buf) {
+                        fprintf(stderr, "Error: could not allocate command buffer.\n");
                         return 1;
                 }
+                sp_txbuf = buf;
+                sp_txsize = size;
         }
+        sp_txbuf[sp_txlen++] = command;
+        if (parmlen)
+                memcpy(sp_txbuf + sp_txlen, params, parmlen);
+        sp_txlen += parmlen;
+
+        sp_queue[sp_queue_len].command = command;
+        sp_queue[sp_queue_len].retlen = retlen;
+        sp_queue[sp_queue_len].retparms = retparms;
+        sp_queue_len++;
+
+        sp_stats.commands++;
+        sp_stats.tx_bytes += 1 + parmlen;
+        sp_stats.rx_bytes += 1 + retlen;
         return 0;
 }
 
-int serprog_spi_send_command(unsigned int writecnt, unsigned int readcnt,
-                             const unsigned char *writearr, unsigned char *readarr)
+static int sp_docommand(uint8_t command, uint32_t parmlen,
+                        uint8_t *params, uint32_t retlen, void *retparms)
+{
+        if (sp_queue_command(command, parmlen, params, retlen, retparms))
+                return 1;
+        return sp_flush();
+}
+
+int serprog_sync()
+{
+    uint8_t buf[8];
+
+    // Send some NOPs to terminate any partially received command, then
+    // discard all the answers.
+    memset(buf, S_CMD_NOP, sizeof(buf));
+    if( serialport_write(buf, sizeof(buf)) )
+        return 1;
+    while( !serialport_read_timeout(buf, 1, 20) )
+        ;
+    serialport_flush_input();
+
+    for(int i = 0; i < 3; i++)
+    {
+        buf[0] = S_CMD_SYNCNOP;
+        if( serialport_write(buf, 1) )
+            return 1;
+        if( !serialport_read_timeout(buf, 2, 50) && buf[0] == S_NAK && buf[1] == S_ACK )
+            return 0;
+        serialport_flush_input();
+    }
+    return 1;
+}
+
+double serprog_measure_rtt(int count)
+{
+    double start = sp_time();
+    for(int i = 0; i < count; i++)
+        if( sp_docommand(S_CMD_NOP, 0, 0, 0, 0) )
+            return -1;
+    return (sp_time() - start) / count;
+}
+
+static int cmd_check(uint8_t cmd, uint8_t map[32])
+{
+    int byte = (cmd >> 3) & 31;
+    int mask = 1 << (cmd & 7);
+    return !(map[byte] & mask);
+}
+
+/* Chooses the read chunk size and the number of reads in flight. The bytes
+ * in flight should cover a few times the bandwidth-delay product so the
+ * round trip is hidden, while one chunk must arrive well within the answer
+ * timeout and the queued commands must fit in the programmer buffer. */
+static void sp_choose_transfer(void)
+{
+    double target = 4 * sp_link.bandwidth * sp_link.rtt;
+    unsigned max = SP_CHUNK_MAX, depth_max = sp_serbuf / (1 + 10);
+    unsigned chunk = SP_CHUNK_MIN;
+
+    if( sp_max_read && sp_max_read < max )
+        max = sp_max_read;
+    while( max > SP_CHUNK_MIN && max > sp_link.bandwidth * SP_CHUNK_TIME )
+        max /= 2;
+    while( chunk < max && chunk < target )
+        chunk *= 2;
+    if( chunk > max )
+        chunk = max;
+
+    if( depth_max > SP_QUEUE_MAX )
+        depth_max = SP_QUEUE_MAX;
+    if( depth_max < 1 )
+        depth_max = 1;
+    sp_link.chunk = chunk;
+    sp_link.depth = target / chunk + 1;
+    if( sp_link.depth > depth_max )
+        sp_link.depth = depth_max;
+}
+
+int serprog_profile_link()
+{
+    uint8_t map[SP_QUEUE_MAX][32];
+    double start, t, bytes = 0;
+    unsigned long trips;
+    unsigned rounds = 0;
+
+    sp_profiling = 1;
+    sp_link.rtt = serprog_measure_rtt(8);
+    if( sp_link.rtt < 0 )
+    {
+        sp_profiling = 0;
+        return 1;
+    }
+
+    // Bulk bandwidth: command map queries, each one answered with 33 bytes.
+    // A small serial buffer splits the batches, so count the real flushes.
+    start = sp_time();
+    trips = sp_stats.flushes;
+    do {
+        for(int i = 0; i < SP_QUEUE_MAX; i++)
+        {
+            if( sp_queue_command(S_CMD_Q_CMDMAP, 0, 0, 32, map[i]) )
+                break;
+            bytes += 1 + 32;
+        }
+        if( sp_flush() )
+        {
+            sp_profiling = 0;
+            return 1;
+        }
+        rounds++;
+    } while( sp_time() - start < 0.05 && rounds < 16 );
+
+    // Remove the round trips, but don't trust tiny differences
+    t = sp_time() - start;
+    trips = sp_stats.flushes - trips;
+    if( t - trips * sp_link.rtt > t / 4 )
+        t -= trips * sp_link.rtt;
+    else
+        t /= 4;
+    sp_link.bandwidth = bytes / t;
+
+    sp_choose_transfer();
+    sp_profiling = sp_retune = 0;
+    fprintf(stderr, "link: round trip %.3f ms, %.1f kB/s, reads of %u bytes, %u in flight\n",
+            1000 * sp_link.rtt, 0.001 * sp_link.bandwidth, sp_link.chunk, sp_link.depth);
+    return 0;
+}
+
+void serprog_get_link(struct serprog_link *link)
+{
+    if( sp_retune )
+        serprog_profile_link();
+    *link = sp_link;
+}
+
+/* Compress "n" bytes from "src" into "dst" using a simple RLE scheme that is
+ * easy to decode on a micro-controller:
+ *  - control byte 0x00 to 0x7F: copy the next (c + 1) literal bytes.
+ *  - control byte 0x80 to 0xFF: repeat the next byte ((c & 0x7F) + 3) times.
+ * Returns the compressed length, or 0 if the result would not be smaller
+ * than the input ("dst" must hold at least "n" bytes). */
+static unsigned sp_rle_encode(const uint8_t *src, unsigned n, uint8_t *dst)
+{
+        unsigned i = 0, o = 0, lit = 0;
+
+        while (i < n) {
+                unsigned run = 1;
+                while (i + run < n && run < 130 && src[i + run] == src[i])
+                        run++;
+                if (run >= 3) {
+                        if (o + 2 >= n)
+                                return 0;
+                        dst[o++] = 0x80 | (run - 3);
+                        dst[o++] = src[i];
+                        i += run;
+                        lit = 0;
+                } else {
+                        /* Start a new literal block or extend the current one */
+                        if (!lit || dst[lit - 1] == 0x7F) {
+                                if (o + 1 >= n)
+                                        return 0;
+                                dst[o++] = 0xFF;
+                                lit = o;
+                        }
+                        if (o + 1 >= n)
+                                return 0;
+                        dst[lit - 1]++;
+                        dst[o++] = src[i++];
+                }
+        }
+        return o;
+}
+
+static int sp_spiop(unsigned int writecnt, unsigned int readcnt,
+                    const unsigned char *writearr, unsigned char *readarr)
 {
         unsigned char *parmbuf;
+        unsigned clen = 0;
         int ret;
 
-        parmbuf = malloc(writecnt + 6);
+        parmbuf = malloc(writecnt + 9);
         if (!parmbuf) {
                 fprintf(stderr, "Error: could not allocate SPI send param buffer.\n");
                 return 1;
@@ -107,12 +457,44 @@ int serprog_spi_send_command(unsigned int writecnt, unsigned int readcnt,
         parmbuf[3] = (readcnt >> 0) & 0xFF;
         parmbuf[4] = (readcnt >> 8) & 0xFF;
         parmbuf[5] = (readcnt >> 16) & 0xFF;
-        memcpy(parmbuf + 6, writearr, writecnt);
-        ret = sp_docommand(S_CMD_O_SPIOP, writecnt + 6, parmbuf, readcnt, readarr);
+        sp_stats.payload_bytes += writecnt;
+
+        if (writecnt >= SP_RLE_MIN_LEN && !cmd_check(S_CMD_O_SPIOP_RLE, sp_caps.cmdmap))
+                clen = sp_rle_encode(writearr, writecnt, parmbuf + 9);
+
+        if (clen) {
+                parmbuf[6] = (clen >> 0) & 0xFF;
+                parmbuf[7] = (clen >> 8) & 0xFF;
+                parmbuf[8] = (clen >> 16) & 0xFF;
+                sp_stats.compressed++;
+                ret = sp_queue_command(S_CMD_O_SPIOP_RLE, clen + 9, parmbuf, readcnt, readarr);
+        } else {
+                memcpy(parmbuf + 6, writearr, writecnt);
+                ret = sp_queue_command(S_CMD_O_SPIOP, writecnt + 6, parmbuf, readcnt, readarr);
+        }
         free(parmbuf);
         return ret;
 }
 
+int serprog_spi_send_command(unsigned int writecnt, unsigned int readcnt,
+                             const unsigned char *writearr, unsigned char *readarr)
+{
+        if (sp_spiop(writecnt, readcnt, writearr, readarr))
+                return 1;
+        return sp_flush();
+}
+
+int serprog_spi_queue_command(unsigned int writecnt, unsigned int readcnt,
+                              const unsigned char *writearr, unsigned char *readarr)
+{
+        return sp_spiop(writecnt, readcnt, writearr, readarr);
+}
+
+int serprog_flush()
+{
+        return sp_flush();
+}
+
 unsigned serprog_spi_set_clock(unsigned clock_hz)
 {
     uint8_t buf[4];
@@ -127,14 +509,30 @@ unsigned serprog_spi_set_clock(unsigned clock_hz)
     return 0;
 }
 
-static int cmd_check(uint8_t cmd, uint8_t map[32])
+/* Queries the programmer capabilities */
+static int sp_query_caps(struct serprog_caps *caps)
 {
-    int byte = (cmd >> 3) & 31;
-    int mask = 1 << (cmd & 7);
-    return !(map[byte] & mask);
+    uint8_t iver[2], buf[16];
+
+    memset(caps, 0, sizeof(*caps));
+    if( sp_docommand(S_CMD_Q_IFACE, 0, 0, 2, iver) || iver[0] != 1 || iver[1] != 0 ||
+        sp_docommand(S_CMD_Q_CMDMAP, 0, 0, 32, caps->cmdmap) )
+        return 1;
+
+    if( !cmd_check( S_CMD_Q_PGMNAME, caps->cmdmap ) && !sp_docommand(S_CMD_Q_PGMNAME, 0, 0, 16, buf) )
+        memcpy(caps->name, buf, 16);
+    if( !cmd_check( S_CMD_Q_SERBUF, caps->cmdmap ) && !sp_docommand(S_CMD_Q_SERBUF, 0, 0, 2, buf) )
+        caps->serbuf = buf[0] | (buf[1] << 8);
+    if( !cmd_check( S_CMD_Q_OPBUF, caps->cmdmap ) && !sp_docommand(S_CMD_Q_OPBUF, 0, 0, 2, buf) )
+        caps->opbuf = buf[0] | (buf[1] << 8);
+    if( !cmd_check( S_CMD_Q_RDNMAXLEN, caps->cmdmap ) && !sp_docommand(S_CMD_Q_RDNMAXLEN, 0, 0, 3, buf) )
+        caps->max_read = buf[0] | (buf[1] << 8) | (buf[2] << 16);
+    if( !cmd_check( S_CMD_Q_WRNMAXLEN, caps->cmdmap ) && !sp_docommand(S_CMD_Q_WRNMAXLEN, 0, 0, 3, buf) )
+        caps->max_write = buf[0] | (buf[1] << 8) | (buf[2] << 16);
+    return 0;
 }
 
-int serprog_detect()
+int serprog_detect(const struct serprog_caps *cached)
 {
     if( sp_docommand(S_CMD_NOP, 0, 0, 0, 0) )
     {
@@ -142,34 +540,150 @@ int serprog_detect()
         return 1;
     }
 
-    uint8_t iver[2], cmdmap[32];
-    if( sp_docommand(S_CMD_Q_IFACE, 0, 0, 2, iver) || iver[0] != 1 || iver[1] != 0 ||
-        sp_docommand(S_CMD_Q_CMDMAP, 0, 0, 32, cmdmap) )
+    if( cached )
+        sp_caps = *cached;
+    else if( sp_query_caps(&sp_caps) )
     {
         fprintf(stderr, "Error, programmer interface invalid\n");
         return 1;
     }
 
     // Check that our commands are available
-    if( cmd_check( S_CMD_O_SPIOP, cmdmap ) )
+    if( cmd_check( S_CMD_O_SPIOP, sp_caps.cmdmap ) )
     {
         fprintf(stderr, "Error, programmer does not support SPI operations\n");
         return 1;
     }
-    if( cmd_check( S_CMD_S_SPI_FREQ, cmdmap ) )
+    if( cmd_check( S_CMD_S_SPI_FREQ, sp_caps.cmdmap ) )
     {
         fprintf(stderr, "Error, programmer does not support setting SPI frequency\n");
         return 1;
     }
-    if( cmd_check( S_CMD_S_PIN_STATE, cmdmap ) )
+    if( cmd_check( S_CMD_S_PIN_STATE, sp_caps.cmdmap ) )
     {
         fprintf(stderr, "Error, programmer does not support enabling and disabling SPI pins\n");
         return 1;
     }
 
+    if( sp_caps.name[0] )
+        fprintf(stderr, "programmer: %s%s\n", sp_caps.name, cached ? " (cached)" : "");
+
+    // Buffer sizes, used to send many commands without waiting
+    sp_serbuf = sp_caps.serbuf < 16 ? 16 : sp_caps.serbuf;
+    fprintf(stderr, "programmer serial buffer: %u bytes\n", (unsigned)sp_serbuf);
+
+    sp_max_read = sp_caps.max_read;
+    if( sp_max_read && sp_max_read < sp_link.chunk )
+        sp_link.chunk = sp_max_read;
+
+    // The operation buffer only holds parallel/LPC/FWH bus writes, it can't
+    // sequence SPI operations, so it is only reported for information.
+    if( sp_caps.opbuf )
+        fprintf(stderr, "programmer operation buffer: %u bytes\n", sp_caps.opbuf);
+    if( sp_caps.max_write )
+        fprintf(stderr, "programmer write-n maximum length: %u bytes\n", sp_caps.max_write);
+    if( !cmd_check( S_CMD_O_SPIOP_RLE, sp_caps.cmdmap ) )
+        fprintf(stderr, "programmer supports compressed SPI operations\n");
+    if( serprog_has_gpio() )
+        fprintf(stderr, "programmer controls CRESET and CDONE\n");
+
+    return 0;
+}
+
+void serprog_get_caps(struct serprog_caps *caps)
+{
+    *caps = sp_caps;
+}
+
+/* Time to wait for the answer of a device being probed */
+#define SP_PROBE_MS		200
+/* Maximum number of devices probed */
+#define SP_PROBE_MAX		32
+
+struct sp_probe {
+    const char *dev;
+    int baud;
+    int found;
+    pthread_t thread;
+};
+
+int serprog_probe(const char *dev, int baud)
+{
+    static const unsigned char req[2] = { S_CMD_NOP, S_CMD_Q_IFACE };
+    unsigned char ans[4];
+
+    return serialport_probe(dev, baud, req, sizeof(req), ans, sizeof(ans), SP_PROBE_MS) ||
+           ans[0] != S_ACK || ans[1] != S_ACK || ans[2] != 1 || ans[3] != 0;
+}
+
+static void *sp_probe_thread(void *arg)
+{
+    struct sp_probe *p = arg;
+
+    p->found = !serprog_probe(p->dev, p->baud);
+    return NULL;
+}
+
+int serprog_discover(int baud, char *dev, unsigned size)
+{
+    static char list[SP_PROBE_MAX][SERIAL_NAME_MAX];
+    struct sp_probe probes[SP_PROBE_MAX];
+    int count = serialport_list_devices(list, SP_PROBE_MAX);
+    int found = -1;
+
+    // Probe all the devices at once, so it takes one timeout at most
+    for(int i = 0; i < count; i++)
+    {
+        probes[i].dev = list[i];
+        probes[i].baud = baud;
+        probes[i].found = 0;
+        if( pthread_create(&probes[i].thread, NULL, sp_probe_thread, &probes[i]) )
+            probes[i].dev = NULL;
+    }
+    for(int i = 0; i < count; i++)
+    {
+        if( !probes[i].dev )
+            continue;
+        pthread_join(probes[i].thread, NULL);
+        if( !probes[i].found )
+            continue;
+        fprintf(stderr, "found programmer at %s\n", list[i]);
+        if( found < 0 )
+            found = i;
+    }
+
+    if( found < 0 )
+        return 1;
+    snprintf(dev, size, "%s", list[found]);
     return 0;
 }
 
+int serprog_has_gpio()
+{
+    return !cmd_check( S_CMD_S_GPIO, sp_caps.cmdmap ) && !cmd_check( S_CMD_Q_GPIO, sp_caps.cmdmap );
+}
+
+int serprog_set_gpio(uint8_t state)
+{
+    // The stream ends once the commands queued before are sent
+    sp_stream |= state & (SERPROG_GPIO_CS_LOW | SERPROG_GPIO_CS_HIGH);
+    if( sp_docommand(S_CMD_S_GPIO, 1, &state, 0, 0) )
+    {
+        fprintf(stderr, "Error, can't set programmer GPIO\n");
+        return 1;
+    }
+    sp_stream = state & (SERPROG_GPIO_CS_LOW | SERPROG_GPIO_CS_HIGH);
+    return 0;
+}
+
+int serprog_get_cdone()
+{
+    uint8_t c;
+    if( sp_docommand(S_CMD_Q_GPIO, 0, 0, 1, &c) )
+        return -1;
+    return c & SERPROG_GPIO_CDONE;
+}
+
 void enable_prog()
 {
     uint8_t c = 1;
@@ -183,3 +697,8 @@ void disable_prog()
     if( sp_docommand(S_CMD_S_PIN_STATE, 1, &c, 0, 0) )
         fprintf(stderr, "Error, can't disable prog\n");
 }
+
+void serprog_get_stats(struct serprog_stats *st)
+{
+    *st = sp_stats;
+}
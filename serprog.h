@@ -25,18 +25,106 @@
 
 #pragma once
 
+#include <stdint.h>
+
+/* Link statistics */
+struct serprog_stats {
+    unsigned long commands;       /* Number of commands sent */
+    unsigned long flushes;        /* Number of round trips sending them */
+    unsigned long tx_bytes;       /* Bytes sent over the link */
+    unsigned long rx_bytes;       /* Bytes received over the link */
+    unsigned long payload_bytes;  /* SPI bytes written, before compression */
+    unsigned long compressed;     /* Number of SPI operations sent compressed */
+    double io_time;               /* Seconds spent waiting for the link */
+    unsigned long retries;        /* Commands sent again after losing sync */
+    double retry_time;            /* Seconds lost recovering from errors */
+};
+
+/* Programmer capabilities */
+struct serprog_caps {
+    uint8_t cmdmap[32];           /* Supported commands bitmap */
+    unsigned serbuf;              /* Serial buffer size, 0 if unknown */
+    unsigned opbuf;               /* Operation buffer size, 0 if unknown */
+    unsigned max_read;            /* Read-n maximum length, 0 if unlimited */
+    unsigned max_write;           /* Write-n maximum length, 0 if unknown */
+    char name[17];                /* Programmer name, empty if unknown */
+};
+
+/* Link profile and the read transfer settings chosen from it */
+struct serprog_link {
+    double rtt;                   /* Seconds for one command round trip */
+    double bandwidth;             /* Bytes per second received in bulk */
+    unsigned chunk;               /* Bytes read by one SPI operation */
+    unsigned depth;               /* SPI reads sent before waiting */
+};
+
 /* Transmit "writecnt" bytes and then receives "readcnt" bytes from SPI */
 int serprog_spi_send_command(unsigned int writecnt, unsigned int readcnt,
                              const unsigned char *writearr, unsigned char *readarr);
 
+/* Queue a SPI transfer without waiting for the programmer answer. The
+ * received bytes are stored in "readarr" by serprog_flush(), so the buffers
+ * must be valid until then. Commands are sent earlier if the programmer
+ * buffer would overflow. */
+int serprog_spi_queue_command(unsigned int writecnt, unsigned int readcnt,
+                              const unsigned char *writearr, unsigned char *readarr);
+
+/* Send all queued commands and wait for the answers. */
+int serprog_flush();
+
 /* Set SPI clock, in Hz, returns actual speed. */
 unsigned serprog_spi_set_clock(unsigned clock_hz);
 
-/* Detect serprog programmer. */
-int serprog_detect();
+/* Synchronize with the programmer using S_CMD_SYNCNOP, returns 0 on
+ * success. */
+int serprog_sync();
+
+/* Measure the average round trip time of "count" NOP commands, in seconds. */
+double serprog_measure_rtt(int count);
+
+/* Measure the round trip time and bandwidth of the link, and choose the
+ * read chunk size and depth from them. Returns 0 on success. */
+int serprog_profile_link();
+
+/* Get the current link profile. If the throughput of the bulk reads dropped
+ * well below the profiled one, the link is measured again first. */
+void serprog_get_link(struct serprog_link *link);
+
+/* Detect serprog programmer. If "cached" is not NULL, the capabilities
+ * are taken from it instead of queried from the programmer. */
+int serprog_detect(const struct serprog_caps *cached);
+
+/* Get the capabilities of the detected programmer. */
+void serprog_get_caps(struct serprog_caps *caps);
+
+/* Returns 0 if a serprog programmer answers at "dev". */
+int serprog_probe(const char *dev, int baud);
+
+/* Probe all the USB serial devices at once, copying to "dev" the name of
+ * the first one answering as a serprog programmer. Returns 0 if found. */
+int serprog_discover(int baud, char *dev, unsigned size);
+
+/* Pins of the GPIO extension: S_CMD_S_GPIO sets CRESET and the chip select
+ * control, S_CMD_Q_GPIO returns CDONE. */
+#define SERPROG_GPIO_CRESET     0x01  /* CRESET_B level, 0 holds the FPGA in reset */
+#define SERPROG_GPIO_CS_LOW     0x02  /* Keep chip select low between SPI operations */
+#define SERPROG_GPIO_CS_HIGH    0x04  /* Keep chip select high, SPI operations only clock */
+#define SERPROG_GPIO_CDONE      0x01  /* CDONE level */
+
+/* Returns nonzero if the programmer supports the GPIO extension. */
+int serprog_has_gpio();
+
+/* Set the CRESET and chip select control pins, returns 0 on success. */
+int serprog_set_gpio(uint8_t state);
+
+/* Read CDONE, returns 1 if high, 0 if low, -1 on error. */
+int serprog_get_cdone();
 
 /* Enable SPI programmer. */
 void enable_prog();
 
 /* Disable SPI programmer - puts pins in input mode. */
 void disable_prog();
+
+/* Get link statistics. */
+void serprog_get_stats(struct serprog_stats *st);